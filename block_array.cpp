@@ -1,37 +1,94 @@
+#define MAXSWAPDIR 64
+
 class BlockArray {
     // double complex data[zblock=0..NB-1][yblock=0..NB-1]
     //     [arr=0..1][zresidual=0..P-1][yresidual=0..P-1][x=0..PPD-1]
     unsigned long long size;
-    Complx *arr;   // But this array may never be allocated!
+    char *arr;   // But this array may never be allocated!
 
 public:
     int ppd, numblock, block;
     long long unsigned int narray;  // Make uint64 to avoid overflow in later calculations
-    char TMPDIR[1024];
+    int nswapdir;       // The number of directories the blocks are striped over
+    char TMPDIR[MAXSWAPDIR][1024];
     int ramdisk;
-    BlockArray(int _ppd, int _numblock, int _narray, char *_dir, int ramdisk) {
+    int floatswap;      // If non-zero, store the swap as ComplxFloat
+    size_t swapsize;    // The number of bytes stored per Complx
+
+    // Each open block carries its own state, so that blocks on different
+    // devices can be read or written concurrently.
+    struct BlockHandle {
+        ComplxFloat *fbuffer;   // Conversion buffer of one block row, if floatswap
+#ifdef DISK
+#ifdef DIRECTIO
+        char filename[1100];
+        off_t fileoffset;
+#else
+        FILE *fp;
+#endif
+#else
+        char *IOptr;
+#endif
+    };
+
+    BlockArray(int _ppd, int _numblock, int _narray, char *_dirs, int ramdisk, int _floatswap) {
+        // _dirs is a colon-separated list of swap directories
         ppd = _ppd;
         numblock = _numblock;
         block = ppd/numblock;
         narray = _narray;
-        strcpy(TMPDIR,_dir);
+        char dirs[4096], *tok, *save;
+        strncpy(dirs,_dirs,4095); dirs[4095] = '\0';
+        nswapdir = 0;
+        for (tok=strtok_r(dirs,":",&save); tok!=NULL; tok=strtok_r(NULL,":",&save)) {
+            assert(nswapdir<MAXSWAPDIR);
+            strcpy(TMPDIR[nswapdir++],tok);
+        }
+        assert(nswapdir>0);
         arr = NULL;
+        floatswap = _floatswap;
+        swapsize = floatswap ? sizeof(ComplxFloat) : sizeof(Complx);
         assert(ppd%2==0);    // PPD must be even, due to incomplete Nyquist code
         assert(numblock%2==0);    // Number of blocks must be even
         assert(ppd==numblock*block);   // We'd like the blocks to divide evenly
         size = 1llu*ppd*ppd*ppd*narray;
 #ifndef DISK
-        arr = new Complx[size];
+        arr = new char[size*swapsize];
 #elif defined DIRECTIO
-        fileoffset = 0;
         diskbuffer = 1024*512;  // Magic number pulled from io_dio.cpp
         ramdisk = 0;
 #endif
     }
-    ~BlockArray() { 
+    ~BlockArray() {
         delete []arr;
     }
 
+    int device(int yblock, int zblock) {
+        // Which swap directory holds this block.  We stripe round-robin
+        // on yblock+zblock, so that both a row of blocks (the Z pass) and
+        // a column of blocks (the XY pass) are spread over all devices.
+        return (yblock+zblock)%nswapdir;
+    }
+
+    // These convert between the Complx that we compute with and the
+    // ComplxFloat that we may store.  The loops are over the flat
+    // re,im pairs so that they vectorize.  The disk routines stage
+    // through the handle's fbuffer, which holds one row of X skewers
+    // (all yresidual of one arr,zresidual), the most we read or write at once.
+    ComplxFloat *tofloat(Complx *src, ComplxFloat *dest, int num) {
+        double *in = (double *)src;
+        float *out = (float *)dest;
+        #pragma omp simd
+        for (int j=0;j<2*num;j++) out[j] = in[j];
+        return dest;
+    }
+    void fromfloat(ComplxFloat *src, Complx *dest, int num) {
+        float *in = (float *)src;
+        double *out = (double *)dest;
+        #pragma omp simd
+        for (int j=0;j<2*num;j++) out[j] = in[j];
+    }
+
     //    Complx *point(int a, int z, int y, int x) {
     //    // Return a pointer to this part of the buffer
     //        int zblock = z/block;
@@ -43,84 +100,99 @@ public:
 #ifdef DIRECTIO
         // These routines are for DIRECTIO
 private:
-    char filename[200];
-    off_t fileoffset;
     int diskbuffer;
 public:
-    void bopen(int yblock, int zblock, const char *mode) {
+    void bopen(BlockHandle &h, int yblock, int zblock, const char *mode) {
         // DirectIO actually opens and closes the files on demand, so we don't need to open the file here
         assert(yblock>=0&&yblock<numblock);
         assert(zblock>=0&&zblock<numblock);
-        sprintf(filename,"%s/zeldovich.%1d.%1d",TMPDIR,yblock,zblock);
-        FILE * outfile = fopen(filename,"a");
+        sprintf(h.filename,"%s/zeldovich.%1d.%1d",TMPDIR[device(yblock,zblock)],yblock,zblock);
+        // Opening for write starts the block over, since we append below.
+        FILE * outfile = fopen(h.filename,mode[0]=='w'?"w":"a");
         assert(outfile != NULL);
         fclose(outfile);
 
-        fileoffset = 0;  // We're opening a new file, so reset the file offset
+        h.fileoffset = 0;  // We're opening a new file, so reset the file offset
+        h.fbuffer = floatswap ? new ComplxFloat[block*ppd] : NULL;
         return;
     }
-    void bclose() { return; }
-    void bwrite(Complx *buffer,int num) {
+    void bclose(BlockHandle &h) { delete []h.fbuffer; return; }
+    void bwrite(BlockHandle &h, Complx *buffer,int num) {
         // Write num Complx numbers to the buffer, increment the pointer
         WriteDirect WD(ramdisk, diskbuffer);
-        int sizebytes = num*sizeof(Complx);
-        WD.BlockingAppend(filename, (char*)buffer, sizebytes);
+        int sizebytes = num*swapsize;
+        assert(num<=block*ppd);
+        char *src = floatswap ? (char *)tofloat(buffer,h.fbuffer,num) : (char *)buffer;
+        WD.BlockingAppend(h.filename, src, sizebytes);
     }
-    void bread(Complx *buffer,int num) {
+    void bread(BlockHandle &h, Complx *buffer,int num) {
         // Read num Complx numbers into the buffer, increment the pointer
         ReadDirect RD(ramdisk, diskbuffer);
-        size_t sizebytes = num*sizeof(Complx);
-        RD.BlockingRead( filename, (char*)buffer, sizebytes, fileoffset);
-        fileoffset += sizebytes;
+        size_t sizebytes = num*swapsize;
+        assert(num<=block*ppd);
+        char *dest = floatswap ? (char *)h.fbuffer : (char *)buffer;
+        RD.BlockingRead( h.filename, dest, sizebytes, h.fileoffset);
+        h.fileoffset += sizebytes;
+        if (floatswap) fromfloat(h.fbuffer,buffer,num);
     }
 #else
     // These routines are for reading blocks on and off disk
-private: 
-    FILE *fp;
 public:
-    void bopen(int yblock, int zblock, const char *mode) {
+    void bopen(BlockHandle &h, int yblock, int zblock, const char *mode) {
         // Set up for reading or writing this block
-        char filename[200];
+        char filename[1100];
         assert(yblock>=0&&yblock<numblock);
         assert(zblock>=0&&zblock<numblock);
-        sprintf(filename,"%s/zeldovich.%1d.%1d",TMPDIR,yblock,zblock);
+        sprintf(filename,"%s/zeldovich.%1d.%1d",TMPDIR[device(yblock,zblock)],yblock,zblock);
+
+        h.fp = fopen(filename,mode);
+        if(h.fp ==NULL) printf("bad filename: %s",filename);
+        assert(h.fp!=NULL);
+        h.fbuffer = floatswap ? new ComplxFloat[block*ppd] : NULL;
 
-        fp = fopen(filename,mode);
-        if(fp ==NULL) printf("bad filename: %s",filename);
-        assert(fp!=NULL);
-        
         return;
     }
-    void bclose() { fclose(fp); return; }
-    void bwrite(Complx *buffer,int num) {
+    void bclose(BlockHandle &h) { fclose(h.fp); delete []h.fbuffer; return; }
+    void bwrite(BlockHandle &h, Complx *buffer,int num) {
         // Write num Complx numbers to the buffer, increment the pointer
-        fwrite(buffer,sizeof(Complx),num,fp);
+        if (floatswap) {
+            assert(num<=block*ppd);
+            fwrite(tofloat(buffer,h.fbuffer,num),sizeof(ComplxFloat),num,h.fp);
+        }
+        else fwrite(buffer,sizeof(Complx),num,h.fp);
     }
-    void bread(Complx *buffer,int num) {
+    void bread(BlockHandle &h, Complx *buffer,int num) {
         // Read num Complx numbers into the buffer, increment the pointer
-        fread(buffer,sizeof(Complx),num,fp);
+        if (floatswap) {
+            assert(num<=block*ppd);
+            fread(h.fbuffer,sizeof(ComplxFloat),num,h.fp);
+            fromfloat(h.fbuffer,buffer,num);
+        } else fread(buffer,sizeof(Complx),num,h.fp);
     }
 #endif
 #else
     // These routines are for reading in and out of a big array in memory
-private: 
-    Complx *IOptr;
 public:
-    void bopen(int yblock, int zblock, const char *mode) {
+    void bopen(BlockHandle &h, int yblock, int zblock, const char *mode) {
         // Set up for reading or writing this block
         assert(yblock>=0&&yblock<numblock);
         assert(zblock>=0&&zblock<numblock);
-        IOptr = arr+(zblock*numblock+yblock)*(block*block*ppd*narray);
+        h.IOptr = arr+(zblock*numblock+yblock)*(block*block*ppd*narray)*swapsize;
+        h.fbuffer = NULL;
         return;
     }
-    void bclose() { IOptr = NULL; return; }
-    void bwrite(Complx *buffer,int num) {
+    void bclose(BlockHandle &h) { h.IOptr = NULL; return; }
+    void bwrite(BlockHandle &h, Complx *buffer,int num) {
         // Write num Complx numbers to the buffer, increment the pointer
-        memcpy(IOptr,buffer,sizeof(Complx)*num); IOptr+=num;
+        if (floatswap) tofloat(buffer,(ComplxFloat *)h.IOptr,num);
+        else memcpy(h.IOptr,buffer,swapsize*num);
+        h.IOptr+=swapsize*num;
     }
-    void bread(Complx *buffer,int num) {
+    void bread(BlockHandle &h, Complx *buffer,int num) {
         // Read num Complx numbers into the buffer, increment the pointer
-        memcpy(buffer,IOptr,sizeof(Complx)*num); IOptr+=num;
+        if (floatswap) fromfloat((ComplxFloat *)h.IOptr,buffer,num);
+        else memcpy(buffer,h.IOptr,swapsize*num);
+        h.IOptr+=swapsize*num;
     }
 #endif
-};
\ No newline at end of file
+};
@@ -0,0 +1,157 @@
+// A progress journal, so that a failed run can be resumed.
+//
+// The journal records how many Y block pairs of the Z pass and how many
+// Z blocks of the XY pass are complete.  With it we keep the RNG states
+// and the histogram of the generated modes at the end of the last Z step,
+// the running density_variance and max_disp, and, for output formats that
+// append, the sizes of the ic_ files at the end of the last XY step.
+// A rerun with the same parameter file picks up after the last completed
+// step; the swap files of completed steps are still on disk, and appended
+// ic_ files are truncated back to their recorded sizes.  Fixed-size
+// formats write each plane in place, so redoing a step just rewrites it.
+//
+// An XY pass over a range of Z blocks keeps its own journal, and only
+// touches the output files of its range.
+//
+// The journal is rewritten in full at each step, via a rename so that
+// it is always consistent.
+
+class Checkpoint {
+public:
+    int enabled;
+    int qappend;    // Non-zero if the ic_ files are appended to
+    ParticleWriter& writer;     // Which knows the output files
+    char filename[1100];
+    char tmpfilename[1100];
+    unsigned long long fingerprint;   // Hash of the parameter file
+    int ppd, numblock, narray, nfile, nrng;
+    int zdone;      // Number of Y block pairs done in the Z pass
+    int xydone;     // Number of Z blocks done in the XY pass
+    int zstart;     // The first Z block of the XY pass
+    int slab_lo, slab_hi;   // The output files [slab_lo,slab_hi) of the XY pass
+    long long int *icsize;    // Size of each output file after the last XY step
+
+    Checkpoint(Parameters& param, int _narray, int _zstart, int zend, int qrange, ParticleWriter& _writer):
+        writer(_writer) {
+        enabled = param.qcheckpoint;
+        qappend = writer.planebytes==0;
+#ifndef DISK
+        // The in-memory BlockArray does not survive the process
+        if (enabled) fprintf(stderr,"Warning: ZD_qcheckpoint needs -DDISK; not checkpointing.\n");
+        enabled = 0;
+#endif
+        ppd = param.ppd; numblock = param.numblock; narray = _narray;
+        nfile = writer.nfile; nrng = ppd/numblock;
+        zdone = xydone = 0;
+        zstart = _zstart;
+        int block = ppd/numblock;
+        slab_lo = writer.FileOf(zstart*block);
+        slab_hi = writer.FileOf(zend*block-1)+1;
+        icsize = new long long int[nfile];
+        for (int s=0;s<nfile;s++) icsize[s] = 0;
+        fingerprint = hash_params(param);
+        if (qrange) sprintf(filename,"%s/zeldovich.checkpoint.%d.%d",param.output_dir,zstart,zend);
+        else sprintf(filename,"%s/zeldovich.checkpoint",param.output_dir);
+        sprintf(tmpfilename,"%s.tmp",filename);
+        if (enabled) load();
+    }
+    ~Checkpoint() { delete []icsize; }
+
+    unsigned long long hash_params(Parameters& param) {
+        // FNV-1a over the parameter file and the derived sizes
+        unsigned long long h = 14695981039346656037ull;
+        for (int j=0;j<param.inputstream->bufferlength;j++) {
+            h ^= (unsigned char) param.inputstream->buffer[j];
+            h *= 1099511628211ull;
+        }
+        h ^= ppd + 1000003ull*(numblock + 1000003ull*narray);
+        return h;
+    }
+
+    void load() {
+        // Fill in our state from an existing journal, if it matches this run.
+        FILE *fp = fopen(filename,"rb");
+        if (fp==NULL) return;   // Nothing to resume
+        char magic[8];
+        unsigned long long fp_fingerprint;
+        int header[5];
+        double reductions[4];
+        int ok = fread(magic,1,8,fp)==8 && strncmp(magic,"ZDCKPT2",8)==0;
+        ok = ok && fread(&fp_fingerprint,sizeof(fp_fingerprint),1,fp)==1;
+        ok = ok && fread(header,sizeof(int),5,fp)==5;
+        ok = ok && fread(reductions,sizeof(double),4,fp)==4;
+        if (!ok || fp_fingerprint!=fingerprint || header[0]!=nrng || header[1]!=nfile
+                || header[4]!=narray) {
+            fprintf(stderr,"Warning: ignoring checkpoint %s, which is from a different run.\n",filename);
+            fclose(fp); return;
+        }
+        zdone = header[2]; xydone = header[3];
+        for (int i=0;i<nrng;i++)
+            if (gsl_rng_fread(fp,rng[i])!=0) ok = 0;
+        if (ok) ok = fread(icsize,sizeof(long long int),nfile,fp)==(size_t)nfile;
+        if (ok) ok = measured_pk.Read(fp);
+        fclose(fp);
+        if (!ok) {
+            fprintf(stderr,"Error: checkpoint %s is truncated.  Remove it to start over.\n",filename);
+            exit(1);
+        }
+        density_variance = reductions[0];
+        for (int i=0;i<3;i++) max_disp[i] = reductions[i+1];
+        printf("Resuming from checkpoint: %d of %d Y blocks, %d Z blocks from %d done.\n",
+            2*zdone, numblock, xydone, zstart);
+    }
+
+    void save() {
+        // Write the journal to a temporary file and then move it into place.
+        if (!enabled) return;
+        FILE *fp = fopen(tmpfilename,"wb");
+        assert(fp!=NULL);
+        int header[5] = { nrng, nfile, zdone, xydone, narray };
+        double reductions[4] = { density_variance, max_disp[0], max_disp[1], max_disp[2] };
+        fwrite("ZDCKPT2",1,8,fp);
+        fwrite(&fingerprint,sizeof(fingerprint),1,fp);
+        fwrite(header,sizeof(int),5,fp);
+        fwrite(reductions,sizeof(double),4,fp);
+        for (int i=0;i<nrng;i++) gsl_rng_fwrite(fp,rng[i]);
+        fwrite(icsize,sizeof(long long int),nfile,fp);
+        measured_pk.Write(fp);
+        fflush(fp);
+        fsync(fileno(fp));
+        assert(ferror(fp)==0);
+        fclose(fp);
+        int ret = rename(tmpfilename,filename);
+        assert(ret==0);
+    }
+
+    void finish_zstep(int yblock) {
+        // Y block pair yblock is stored.
+        zdone = yblock+1;
+        save();
+    }
+    void begin_xy() {
+        // Cut the ic_ files back to the end of the last completed XY step,
+        // removing anything that a partial step appended.  On a fresh
+        // XY pass this clears out the ic_ files of any earlier run.
+        char fn[1100];
+        if (!enabled||!qappend) return;
+        for (int s=slab_lo;s<slab_hi;s++) {
+            writer.FileName(s,fn);
+            if (icsize[s]>0) {
+                int ret = truncate(fn,icsize[s]);
+                assert(ret==0);
+            } else unlink(fn);
+        }
+    }
+    void finish_xystep(int zblock) {
+        // Z block zblock has been output.  Record the ic_ file sizes.
+        struct stat st;
+        char fn[1100];
+        if (!enabled) return;
+        for (int s=slab_lo;s<slab_hi&&qappend;s++) {
+            writer.FileName(s,fn);
+            icsize[s] = stat(fn,&st)==0 ? st.st_size : 0;
+        }
+        xydone = zblock+1-zstart;
+        save();
+    }
+};
@@ -0,0 +1,218 @@
+// Checksums of the output files.
+//
+// Each write of an output file, whether a plane (or its part of a column)
+// or a piece of a file header, is hashed as it goes out, with the 64-bit
+// XXH64 hash.  The digest of a file is then the XXH64 of the list of its
+// pieces, (offset, bytes, hash) as three little-endian 64-bit integers
+// each, in order of offset.  So the digest doesn't depend on the order
+// or the threads in which the pieces were written, and never needs the
+// file to be read back.
+
+#define XXH_PRIME1 11400714785074694791ull
+#define XXH_PRIME2 14029467366897019727ull
+#define XXH_PRIME3 1609587929392839161ull
+#define XXH_PRIME4 9650029242287828579ull
+#define XXH_PRIME5 2870177450012600261ull
+
+// These read little-endian data, on a little-endian machine
+static inline unsigned long long xxh_read64(const unsigned char *p) {
+    unsigned long long v; memcpy(&v,p,8); return v;
+}
+static inline unsigned long long xxh_read32(const unsigned char *p) {
+    unsigned int v; memcpy(&v,p,4); return v;
+}
+static inline unsigned long long xxh_rotl(unsigned long long x, int r) {
+    return (x<<r)|(x>>(64-r));
+}
+static inline unsigned long long xxh_round(unsigned long long acc, unsigned long long input) {
+    acc += input*XXH_PRIME2;
+    return xxh_rotl(acc,31)*XXH_PRIME1;
+}
+static inline unsigned long long xxh_merge(unsigned long long h, unsigned long long v) {
+    h ^= xxh_round(0,v);
+    return h*XXH_PRIME1+XXH_PRIME4;
+}
+
+unsigned long long xxh64(const void *input, size_t len, unsigned long long seed) {
+    const unsigned char *p = (const unsigned char *)input, *end = p+len;
+    unsigned long long h;
+    if (len>=32) {
+        unsigned long long v1 = seed+XXH_PRIME1+XXH_PRIME2, v2 = seed+XXH_PRIME2;
+        unsigned long long v3 = seed, v4 = seed-XXH_PRIME1;
+        do {
+            v1 = xxh_round(v1,xxh_read64(p));
+            v2 = xxh_round(v2,xxh_read64(p+8));
+            v3 = xxh_round(v3,xxh_read64(p+16));
+            v4 = xxh_round(v4,xxh_read64(p+24));
+            p += 32;
+        } while (p+32<=end);
+        h = xxh_rotl(v1,1)+xxh_rotl(v2,7)+xxh_rotl(v3,12)+xxh_rotl(v4,18);
+        h = xxh_merge(h,v1); h = xxh_merge(h,v2);
+        h = xxh_merge(h,v3); h = xxh_merge(h,v4);
+    } else h = seed+XXH_PRIME5;
+    h += len;
+    for (;p+8<=end;p+=8) {
+        h ^= xxh_round(0,xxh_read64(p));
+        h = xxh_rotl(h,27)*XXH_PRIME1+XXH_PRIME4;
+    }
+    if (p+4<=end) {
+        h ^= xxh_read32(p)*XXH_PRIME1;
+        h = xxh_rotl(h,23)*XXH_PRIME2+XXH_PRIME3;
+        p += 4;
+    }
+    for (;p<end;p++) {
+        h ^= (*p)*XXH_PRIME5;
+        h = xxh_rotl(h,11)*XXH_PRIME1;
+    }
+    h ^= h>>33; h *= XXH_PRIME2;
+    h ^= h>>29; h *= XXH_PRIME3;
+    h ^= h>>32;
+    return h;
+}
+
+struct OutputPiece {
+    long long offset, nbytes;
+    unsigned long long hash;
+};
+
+static bool PieceBefore(const OutputPiece& a, const OutputPiece& b) { return a.offset<b.offset; }
+
+int SortPieces(std::vector<OutputPiece>& pieces, long long size) {
+    // Order the pieces by offset.  A piece written more than once (by a
+    // rerun) keeps its last hash.  Return 1 if the pieces then cover
+    // [0,size) exactly.
+    std::stable_sort(pieces.begin(), pieces.end(), PieceBefore);
+    size_t n = 0;
+    for (size_t j=0;j<pieces.size();j++) {
+        if (n>0 && pieces[n-1].offset==pieces[j].offset) n--;
+        pieces[n++] = pieces[j];
+    }
+    pieces.resize(n);
+    long long end = 0;
+    for (size_t j=0;j<n;j++) {
+        if (pieces[j].offset!=end) return 0;
+        end += pieces[j].nbytes;
+    }
+    return end==size;
+}
+
+unsigned long long PiecesDigest(std::vector<OutputPiece>& pieces) {
+    // The digest of a file from its sorted pieces
+    std::vector<unsigned long long> list(3*pieces.size());
+    for (size_t j=0;j<pieces.size();j++) {
+        list[3*j] = pieces[j].offset;
+        list[3*j+1] = pieces[j].nbytes;
+        list[3*j+2] = pieces[j].hash;
+    }
+    return xxh64(list.data(), list.size()*sizeof(unsigned long long), 0);
+}
+
+int WriteManifest(Parameters& param, const char *output_dir) {
+    // Gather the markers of the complete output files in output_dir into
+    // manifest/MANIFEST, in order of file, and list them in the run
+    // header as well.  Return the number of files.
+    std::vector<std::pair<int,std::string> > lines;
+    char dir[1100], fn[2300], line[2300];
+    sprintf(dir, "%s/manifest", output_dir);
+    DIR *d = opendir(dir);
+    if (d==NULL) return 0;
+    struct dirent *ent;
+    while ((ent=readdir(d))!=NULL) {
+        int len = strlen(ent->d_name);
+        if (len<5 || strcmp(ent->d_name+len-5,".done")!=0) continue;
+        sprintf(fn, "%s/%s", dir, ent->d_name);
+        FILE *fp = fopen(fn, "r");
+        if (fp==NULL) continue;     // Being rewritten
+        int file;
+        if (fgets(line, sizeof(line), fp)!=NULL && sscanf(line, "%d", &file)==1)
+            lines.push_back(std::make_pair(file, std::string(line)));
+        fclose(fp);
+    }
+    closedir(d);
+    std::sort(lines.begin(), lines.end());
+    char tmp[1200];
+    sprintf(fn, "%s/MANIFEST", dir);
+    sprintf(tmp, "%s/MANIFEST.tmp.%d", dir, (int)getpid());
+    FILE *fp = fopen(tmp, "w");
+    assert(fp!=NULL);
+    fprintf(fp, "# file bytes xxh64 name\n");
+    for (size_t j=0;j<lines.size();j++) fputs(lines[j].second.c_str(), fp);
+    int ok = fclose(fp)==0 && rename(tmp, fn)==0;
+    assert(ok);
+
+    sprintf(fn, "%s/zeldovich.header", output_dir);
+    sprintf(tmp, "%s/zeldovich.header.tmp.%d", output_dir, (int)getpid());
+    fp = fopen(tmp, "w");
+    assert(fp!=NULL);
+    param.print(fp, "zeldovich_manifest");
+    fprintf(fp, "# The complete output files: file bytes xxh64 name\n");
+    for (size_t j=0;j<lines.size();j++) fprintf(fp, "#%s", lines[j].second.c_str());
+    ok = fclose(fp)==0 && rename(tmp, fn)==0;
+    assert(ok);
+    return lines.size();
+}
+
+int VerifyFile(const char *output_dir, const char *sidecar) {
+    // Check an output file against its list of pieces, and report the
+    // pieces that don't match.  Return 1 if the file is damaged.
+    FILE *fp = fopen(sidecar, "r");
+    if (fp==NULL) return 0;     // Being rewritten
+    char name[1080], fn[2200];
+    long long size;
+    unsigned long long digest;
+    std::vector<OutputPiece> pieces;
+    OutputPiece piece;
+    int ok = fscanf(fp, "# %1079s %lld %llx", name, &size, &digest)==3;
+    while (ok && fscanf(fp, "%lld %lld %llx", &piece.offset, &piece.nbytes, &piece.hash)==3)
+        pieces.push_back(piece);
+    fclose(fp);
+    if (!ok || !SortPieces(pieces, size) || PiecesDigest(pieces)!=digest) {
+        fprintf(stderr, "Error: %s is not a valid list of pieces.\n", sidecar);
+        return 1;
+    }
+    sprintf(fn, "%s/%s", output_dir, name);
+    int fd = open(fn, O_RDONLY);
+    struct stat st;
+    if (fd<0 || fstat(fd, &st)!=0 || st.st_size!=size) {
+        fprintf(stderr, "Error: %s is missing or is not %lld bytes.\n", fn, size);
+        if (fd>=0) close(fd);
+        return 1;
+    }
+    int bad = 0;
+    std::vector<char> buffer;
+    for (size_t j=0;j<pieces.size();j++) {
+        buffer.resize(pieces[j].nbytes);
+        if (pread(fd, buffer.data(), pieces[j].nbytes, pieces[j].offset)!=pieces[j].nbytes
+            || xxh64(buffer.data(), pieces[j].nbytes, 0)!=pieces[j].hash) {
+            fprintf(stderr, "Error: %s is damaged in bytes [%lld,%lld).\n", fn,
+                pieces[j].offset, pieces[j].offset+pieces[j].nbytes);
+            bad = 1;
+        }
+    }
+    close(fd);
+    return bad;
+}
+
+int VerifyManifest(const char *output_dir) {
+    // Check every output file in output_dir that has a list of pieces, in parallel.
+    // Return the number of damaged files.
+    char dir[1100];
+    sprintf(dir, "%s/manifest", output_dir);
+    std::vector<std::string> sidecars;
+    DIR *d = opendir(dir);
+    if (d!=NULL) {
+        struct dirent *ent;
+        while ((ent=readdir(d))!=NULL) {
+            int len = strlen(ent->d_name);
+            if (len>4 && strcmp(ent->d_name+len-4,".xxh")==0)
+                sidecars.push_back(std::string(dir)+"/"+ent->d_name);
+        }
+        closedir(d);
+    }
+    int nbad = 0;
+    #pragma omp parallel for schedule(dynamic,1) reduction(+:nbad)
+    for (int j=0;j<(int)sidecars.size();j++)
+        nbad += VerifyFile(output_dir, sidecars[j].c_str());
+    printf("Verified %d output files: %d damaged.\n", (int)sidecars.size(), nbad);
+    return nbad;
+}
@@ -0,0 +1,304 @@
+// Writers for Gadget-2 binary and HDF5 initial conditions, so that the
+// ICs can be fed directly to codes other than Abacus.
+//
+// The particles are all of type 1.  Positions are absolute, the lattice
+// plus the displacement, wrapped into [0,BoxSize).  Velocities are
+// peculiar velocities in km/s, divided by sqrt(a) as Gadget expects.
+// Lengths are in the units of BoxSize, assumed to be Mpc/h for the
+// particle mass (in 1e10 Msun/h).  The IDs are the lattice index
+// (z*PPD+y)*PPD+x, 64-bit if they won't fit in 32.
+//
+// The files are split either by ic_ slab or by ZD_ParticlesPerFile
+// (or ZD_FileBytes), rounded to whole z planes.
+
+class GadgetHeader {
+public:
+    int npart[6];
+    double mass[6];
+    double time;
+    double redshift;
+    int flag_sfr;
+    int flag_feedback;
+    unsigned int npartTotal[6];
+    int flag_cooling;
+    int num_files;
+    double BoxSize;
+    double Omega0;
+    double OmegaLambda;
+    double HubbleParam;
+    int flag_stellarage;
+    int flag_metals;
+    unsigned int npartTotalHighWord[6];
+    int flag_entropy_instead_u;
+    char fill[60];      // Pad to 256 bytes
+};
+
+class GadgetParticleWriter: public ParticleWriter {
+    // Each file is three Fortran-style records after the header:
+    // POS[N][3] and VEL[N][3] as float, then ID[N].  Each plane fills its
+    // part of all three, so we write them as columns.
+public:
+    size_t idbytes;
+    double scalefactor, vfactor, partmass;
+
+    GadgetParticleWriter(Parameters& _param, int start=1):
+    ParticleWriter(_param, PlaneBytes(_param), PlaneBytes(_param)) {
+        long long n = 1ll*param.ppd*param.ppd;
+        idbytes = IDBytes(param);
+        ncolumn = 3;
+        colbytes[0] = colbytes[1] = 3*sizeof(float)*n;
+        colbytes[2] = idbytes*n;
+        headerbytes = 4+sizeof(GadgetHeader)+4;
+        assert(sizeof(GadgetHeader)==256);
+
+        ChunkFiles();
+        // The record lengths are 32-bit
+        int maxplanes = 0;
+        for (int f=0;f<nfile;f++)
+            if (FirstPlane(f+1)-FirstPlane(f)>maxplanes) maxplanes = FirstPlane(f+1)-FirstPlane(f);
+        if (1ll*maxplanes*colbytes[0]>2147483647ll) {
+            fprintf(stderr,"Error: %d planes per Gadget file is too many.  Set ZD_ParticlesPerFile to at most %lld.\n",
+                maxplanes, 2147483647ll/colbytes[0]*n);
+            exit(1);
+        }
+
+        // Velocity conversion.  Our velocities are the displacement scaled
+        // to the EdS growth rate, so v = f*a*H*vel; Gadget wants v/sqrt(a).
+        double a = 1.0/(1.0+param.z_initial);
+        double E = sqrt(param.Omega_M/(a*a*a)+1.0-param.Omega_M);
+        double f = pow(param.Omega_M/(a*a*a)/(E*E), 0.55);
+        scalefactor = a;
+        vfactor = f*100.0*E*sqrt(a);
+        // 27.7536627 is the critical density in 1e10 Msun/h / (Mpc/h)^3
+        partmass = 27.7536627*param.Omega_M*pow(param.boxsize/param.ppd,3);
+        if (start) Start();
+    }
+
+    static size_t IDBytes(Parameters& param) {
+        return 1ll*param.ppd*param.ppd*param.ppd>4294967295ll ? 8 : 4;
+    }
+    static size_t PlaneBytes(Parameters& param) {
+        return (6*sizeof(float)+IDBytes(param))*param.ppd*param.ppd;
+    }
+
+    void FileName(int file, char *fn) { sprintf(fn, "%s/ic_gadget.%d",output_dir,file); }
+
+    // Each record is bracketed by its length
+    off_t ColumnStart(int nplanes, int c) {
+        off_t start = headerbytes;
+        for (int j=0;j<c;j++) start += 8+(off_t)nplanes*colbytes[j];
+        return start+4;
+    }
+    off_t FileBytes(int nplanes) { return ColumnStart(nplanes,ncolumn)-4; }
+
+    void FillHeader(GadgetHeader &head, int nplanes) {
+        memset(&head,0,sizeof(head));
+        long long total = 1ll*param.ppd*param.ppd*param.ppd;
+        head.npart[1] = 1ll*nplanes*param.ppd*param.ppd;
+        head.mass[1] = partmass;
+        head.time = scalefactor;
+        head.redshift = param.z_initial;
+        head.npartTotal[1] = total & 0xffffffffll;
+        head.npartTotalHighWord[1] = total>>32;
+        head.num_files = nfile;
+        head.BoxSize = param.boxsize;
+        head.Omega0 = param.Omega_M;
+        head.OmegaLambda = 1.0-param.Omega_M;
+        head.HubbleParam = param.hubble;
+    }
+
+    void WriteFileHeader(int fd, int file, int first, int last) {
+        GadgetHeader head;
+        int nplanes = last-first;
+        int len = sizeof(head);
+        FillHeader(head, nplanes);
+        WritePiece(file, fd, (char *)&len, 4, 0);
+        WritePiece(file, fd, (char *)&head, sizeof(head), 4);
+        WritePiece(file, fd, (char *)&len, 4, 4+sizeof(head));
+        for (int c=0;c<ncolumn;c++) {
+            off_t start = ColumnStart(nplanes,c);
+            len = nplanes*colbytes[c];
+            WritePiece(file, fd, (char *)&len, 4, start-4);
+            WritePiece(file, fd, (char *)&len, 4, start+len);
+        }
+    }
+
+    size_t ConvertPlane(int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
+    BlockArray& array, char *buffer, PlaneStats& stats) {
+        double pos[4], vel[3];
+        float *posout = (float *) buffer;
+        float *velout = (float *) (buffer+colbytes[0]);
+        char *idout = buffer+colbytes[0]+colbytes[1];
+        for (int y=0;y<array.ppd;y++)
+        for (int x=0;x<array.ppd;x++) {
+            LoadParticle(y,x,slab1,slab2,slab3,slab4,array,param,pos,vel);
+            stats.Accumulate(pos);
+            double abspos[3] = { x*param.separation+pos[0], y*param.separation+pos[1], z*param.separation+pos[2] };
+            for (int i=0;i<3;i++) {
+                WRAP(abspos[i]);
+                float p = abspos[i];
+                if (p>=param.boxsize) p = 0.0;   // Rounding may land on the edge
+                *posout++ = p;
+                *velout++ = vel[i]*vfactor;
+            }
+            unsigned long long id = (1ull*z*array.ppd+y)*array.ppd+x;
+            if (idbytes==8) { memcpy(idout,&id,8); idout += 8; }
+            else { unsigned int id32 = id; memcpy(idout,&id32,4); idout += 4; }
+        }
+        return planebytes;
+    }
+
+    void Summary() {
+        printf("Wrote %d Gadget files, with particle mass %g and velocity factor %g.\n",
+            nfile, partmass, vfactor);
+    }
+};
+
+#ifdef HDF5
+class HDF5ParticleWriter: public GadgetParticleWriter {
+    // The same particles in the Gadget HDF5 layout: a Header group of
+    // attributes, and PartType1/{Coordinates,Velocities,ParticleIDs}.
+    // The datasets are created at full size, and each plane is written
+    // into its rows, so rerunning planes is harmless.  HDF5 is not
+    // thread-safe, so all of our HDF5 calls hold h5lock.
+    // A run that writes a file from its first plane creates it afresh, so
+    // that nothing left by an earlier run (of another PPD or format, say)
+    // survives; only a resumed run reopens a file that it did not create.
+    hid_t *h5;
+    char *created;      // Non-zero for the files this run has created
+    pthread_mutex_t h5lock;
+public:
+    HDF5ParticleWriter(Parameters& _param): GadgetParticleWriter(_param, 0) {
+        shareable = 0;  // Two jobs can't write one HDF5 file at once
+        qhashplanes = 0;    // The library decides the layout
+        h5 = new hid_t[nfile];
+        created = new char[nfile];
+        for (int f=0;f<nfile;f++) created[f] = 0;
+        pthread_mutex_init(&h5lock,NULL);
+        Start();
+    }
+    ~HDF5ParticleWriter() {
+        Close();    // While our CloseFile is still in reach
+        delete []h5;
+        delete []created;
+        pthread_mutex_destroy(&h5lock);
+    }
+    void Reset(const char *dir) {
+        // The next realization is a new run, in a new directory
+        ParticleWriter::Reset(dir);
+        for (int f=0;f<nfile;f++) created[f] = 0;
+    }
+
+    void FileName(int file, char *fn) { sprintf(fn, "%s/ic_gadget.%d.hdf5",output_dir,file); }
+    off_t FileBytes(int nplanes) { return -1; }    // Up to the library
+
+    void attribute(hid_t group, const char *name, hid_t type, int n, const void *data) {
+        hsize_t dim = n;
+        hid_t space = n>1 ? H5Screate_simple(1,&dim,NULL) : H5Screate(H5S_SCALAR);
+        hid_t attr = H5Acreate2(group, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+        H5Awrite(attr, type, data);
+        H5Aclose(attr);
+        H5Sclose(space);
+    }
+
+    void dataset(hid_t group, const char *name, hid_t type, hsize_t nrow, hsize_t ncol) {
+        hsize_t dims[2] = { nrow, ncol };
+        hid_t space = H5Screate_simple(ncol>1?2:1, dims, NULL);
+        hid_t dset = H5Dcreate2(group, name, type, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        assert(dset>=0);
+        H5Dclose(dset);
+        H5Sclose(space);
+    }
+
+protected:
+    void OpenFile(int file, int first, int last) {
+        char fn[1080];
+        FileName(file, fn);
+        if (qmanifest) Unmark(file);
+        pthread_mutex_lock(&h5lock);
+        if (created[file] || first<zlo) h5[file] = H5Fopen(fn, H5F_ACC_RDWR, H5P_DEFAULT);
+        else {
+            h5[file] = H5Fcreate(fn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+            created[file] = 1;
+            GadgetHeader head;
+            FillHeader(head, last-first);
+            double mass[6]; unsigned int npart[6];
+            for (int t=0;t<6;t++) { mass[t] = head.mass[t]; npart[t] = head.npart[t]; }
+            hid_t g = H5Gcreate2(h5[file], "/Header", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+            attribute(g, "NumPart_ThisFile", H5T_NATIVE_UINT, 6, npart);
+            attribute(g, "NumPart_Total", H5T_NATIVE_UINT, 6, head.npartTotal);
+            attribute(g, "NumPart_Total_HighWord", H5T_NATIVE_UINT, 6, head.npartTotalHighWord);
+            attribute(g, "MassTable", H5T_NATIVE_DOUBLE, 6, mass);
+            attribute(g, "Time", H5T_NATIVE_DOUBLE, 1, &head.time);
+            attribute(g, "Redshift", H5T_NATIVE_DOUBLE, 1, &head.redshift);
+            attribute(g, "BoxSize", H5T_NATIVE_DOUBLE, 1, &head.BoxSize);
+            attribute(g, "NumFilesPerSnapshot", H5T_NATIVE_INT, 1, &head.num_files);
+            attribute(g, "Omega0", H5T_NATIVE_DOUBLE, 1, &head.Omega0);
+            attribute(g, "OmegaLambda", H5T_NATIVE_DOUBLE, 1, &head.OmegaLambda);
+            attribute(g, "HubbleParam", H5T_NATIVE_DOUBLE, 1, &head.HubbleParam);
+            attribute(g, "Flag_Sfr", H5T_NATIVE_INT, 1, &head.flag_sfr);
+            attribute(g, "Flag_Cooling", H5T_NATIVE_INT, 1, &head.flag_cooling);
+            attribute(g, "Flag_StellarAge", H5T_NATIVE_INT, 1, &head.flag_stellarage);
+            attribute(g, "Flag_Metals", H5T_NATIVE_INT, 1, &head.flag_metals);
+            attribute(g, "Flag_Feedback", H5T_NATIVE_INT, 1, &head.flag_feedback);
+            H5Gclose(g);
+            g = H5Gcreate2(h5[file], "/PartType1", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+            hsize_t n = 1ull*(last-first)*param.ppd*param.ppd;
+            dataset(g, "Coordinates", H5T_NATIVE_FLOAT, n, 3);
+            dataset(g, "Velocities", H5T_NATIVE_FLOAT, n, 3);
+            dataset(g, "ParticleIDs", idbytes==8?H5T_NATIVE_UINT64:H5T_NATIVE_UINT32, n, 1);
+            H5Gclose(g);
+        }
+        if (h5[file]<0) {
+            fprintf(stderr,"Error: could not open %s\n",fn);
+            exit(1);
+        }
+        pthread_mutex_unlock(&h5lock);
+        files[file].fd = 0;     // Marks the file as open
+    }
+    void CloseFile(int file) {
+        pthread_mutex_lock(&h5lock);
+        H5Fclose(h5[file]);
+        pthread_mutex_unlock(&h5lock);
+        files[file].fd = -1;
+        // We can only hash the finished file
+        if (qmanifest && param.qoneslab<0) FinishFile(file, HashFile(file));
+    }
+
+    void WriteJobData(WriteJob &job, int fd) {
+        const char *names[3] = { "/PartType1/Coordinates", "/PartType1/Velocities", "/PartType1/ParticleIDs" };
+        hid_t types[3] = { H5T_NATIVE_FLOAT, H5T_NATIVE_FLOAT, idbytes==8?H5T_NATIVE_UINT64:H5T_NATIVE_UINT32 };
+        hsize_t n = 1ull*param.ppd*param.ppd;
+        hsize_t start[2] = { (job.z-FirstPlane(job.file))*n, 0 };
+        char *src = job.buffer;
+        pthread_mutex_lock(&h5lock);
+        for (int c=0;c<3;c++) {
+            hsize_t count[2] = { n, c<2 ? 3u : 1u };
+            hid_t dset = H5Dopen2(h5[job.file], names[c], H5P_DEFAULT);
+            hid_t filespace = H5Dget_space(dset);
+            H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL);
+            hid_t memspace = H5Screate_simple(c<2?2:1, count, NULL);
+            herr_t ret = H5Dwrite(dset, types[c], memspace, filespace, H5P_DEFAULT, src);
+            if (ret<0) {
+                fprintf(stderr,"Error: writing %s of file %d failed\n", names[c], job.file);
+                exit(1);
+            }
+            H5Sclose(memspace);
+            H5Sclose(filespace);
+            H5Dclose(dset);
+            src += colbytes[c];
+        }
+        pthread_mutex_unlock(&h5lock);
+    }
+};
+#endif
+
+ParticleWriter *NewGadgetWriter(Parameters& param, int qhdf5) {
+    if (!qhdf5) return new GadgetParticleWriter(param);
+#ifdef HDF5
+    return new HDF5ParticleWriter(param);
+#else
+    fprintf(stderr, "Error: ICFormat \"HDF5\" needs a build with -DHDF5. Aborting.\n");
+    exit(1);
+#endif
+}
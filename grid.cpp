@@ -0,0 +1,311 @@
+// Real-space grids of the linear fields, for analysis.
+//
+// With ZD_qdensity, the density contrast, and with ZD_qdisplacement the
+// three components of the displacement, are written as PPD^3 grids of
+// floats in (z,y,x) order, x fastest, one file per field, after the
+// parameter file header (unless ZD_qnoheader).  Each file is preallocated,
+// and each plane is converted and written with pwrite() at its own offset
+// by the thread that transformed it, straight from the FFT output.  So the
+// planes go out in parallel and in any order, rewriting a plane is
+// harmless, and separate XY jobs may share the files.
+
+class GridWriter {
+public:
+    Parameters& param;
+    int ngrid;          // The number of fields written
+    int field[4];       // Which: 0 for density, 1-3 for displ_x, displ_y, displ_z
+    int fd[4];
+    off_t headerbytes;  // The size of the header before each grid
+    int nthread;
+    float **plane;      // A plane of floats for each thread
+
+    GridWriter(Parameters& _param): param(_param) {
+        ngrid = 0;
+        if (param.qdensity>0) field[ngrid++] = 0;
+        if (param.qdisplacement>0) for (int i=1;i<=3;i++) field[ngrid++] = i;
+        headerbytes = 0;
+        nthread = 0;
+        plane = NULL;
+        if (ngrid==0) return;
+        Open();
+        nthread = omp_get_max_threads();
+        plane = new float *[nthread];
+        for (int t=0;t<nthread;t++) plane[t] = new float[param.ppd*param.ppd];
+    }
+    ~GridWriter() {
+        for (int g=0;g<ngrid;g++) close(fd[g]);
+        for (int t=0;t<nthread;t++) delete []plane[t];
+        delete []plane;
+    }
+
+    void Reset() {
+        // Start the files of the next realization of a batch, which has
+        // its own names and header, keeping the planes
+        for (int g=0;g<ngrid;g++) close(fd[g]);
+        if (ngrid>0) Open();
+    }
+
+    void Open() {
+        // Make the files, at full size, with their headers
+        char *header = NULL;
+        size_t headerlen = 0;
+        if (param.qnoheader==0) {
+            FILE *fp = open_memstream(&header, &headerlen);
+            assert(fp!=NULL);
+            param.print(fp,"zeldovich_1float");
+            fclose(fp);
+        }
+        headerbytes = headerlen;
+        off_t size = headerbytes+(off_t)sizeof(float)*param.ppd*param.ppd*param.ppd;
+        const char *suffix[4] = { "", ".displ_x", ".displ_y", ".displ_z" };
+        for (int g=0;g<ngrid;g++) {
+            char fn[300];
+            sprintf(fn, "%s%s", param.density_filename, suffix[field[g]]);
+            fd[g] = open(fn, O_WRONLY|O_CREAT, 0644);
+            if (fd[g]<0) {
+                fprintf(stderr,"Error: could not open %s: %s\n",fn,strerror(errno));
+                exit(1);
+            }
+            fallocate(fd[g], 0, 0, size);
+            int ret = ftruncate(fd[g], size);
+            assert(ret==0);
+            if (headerlen>0) Write(g, header, headerlen, 0);
+        }
+        free(header);
+    }
+
+    void WritePlane(int z, Complx *slab1, Complx *slab2, BlockArray& array) {
+        // Write plane z of each field, from the transformed arrays
+        // (in the packing of LoadParticle).  Called by the computing threads.
+        if (ngrid==0) return;
+        float *out = plane[omp_get_thread_num()];
+        size_t nbytes = sizeof(float)*array.ppd*array.ppd;
+        for (int g=0;g<ngrid;g++) {
+            for (int y=0;y<array.ppd;y++)
+            for (int x=0;x<array.ppd;x++) {
+                switch (field[g]) {
+                    case 0: out[x+array.ppd*y] = real(YX(slab1,y,x)); break;
+                    case 1: out[x+array.ppd*y] = imag(YX(slab1,y,x)); break;
+                    case 2: out[x+array.ppd*y] = real(YX(slab2,y,x)); break;
+                    default: out[x+array.ppd*y] = imag(YX(slab2,y,x)); break;
+                }
+            }
+            Write(g, (char *)out, nbytes, headerbytes+(off_t)z*nbytes);
+        }
+    }
+
+private:
+    void Write(int g, const char *src, size_t nbytes, off_t offset) {
+        size_t done = 0;
+        while (done<nbytes) {
+            ssize_t ret = pwrite(fd[g], src+done, nbytes-done, offset+done);
+            if (ret<0 && errno==EINTR) continue;
+            if (ret<=0) {
+                fprintf(stderr,"Error: writing the density grid failed: %s\n",strerror(errno));
+                exit(1);
+            }
+            done += ret;
+        }
+    }
+};
+
+// ===============================================================
+
+// The cloud-in-cell density of the displaced particles, on a grid of
+// ZD_CICGrid^3 cells, accumulated during the XY pass.  The grid points
+// are at multiples of BoxSize/ZD_CICGrid, so that with ZD_CICGrid=PPD an
+// undisplaced particle falls on one point.  Each thread deposits the
+// planes it transforms into a window of grid planes of its own, those of
+// the current Z block and one more on either side, so that particles
+// that cross slab boundaries need no locking.  The rare particle that
+// moves further is added to the grid itself, atomically.  After each Z
+// block the windows are added to the grid and cleared.  The weights are
+// held in fixed point, so that the sums don't depend on the order or the
+// number of threads.
+//
+// An XY range job writes its sums to zeldovich.cic.<zstart>.<zend>, and
+// the finalize stage adds them up.
+
+#define CIC_ONE (1ll<<24)   // The fixed-point weight of one particle
+
+class CICDensity {
+public:
+    Parameters& param;
+    int ngrid;          // The grid size, or 0 if not depositing
+    int nthread;
+    long long *total;   // The sums
+    int nwindow;        // The grid planes in each window
+    int zlow;           // The first of them (maybe wrapped)
+    long long **grid;   // The window of each thread
+
+    CICDensity(Parameters& _param, int _nthread): param(_param) {
+        ngrid = _nthread>0 ? param.cic_grid : 0;
+        nthread = ngrid>0 ? _nthread : 0;
+        total = new long long[Cells()];
+        memset(total, 0, Cells()*sizeof(long long));
+        nwindow = WindowPlanes(param);
+        zlow = 0;
+        grid = new long long *[nthread];
+        for (int t=0;t<nthread;t++) {
+            grid[t] = new long long[WindowCells()];
+            memset(grid[t], 0, WindowCells()*sizeof(long long));
+        }
+    }
+    ~CICDensity() {
+        for (int t=0;t<nthread;t++) delete []grid[t];
+        delete []grid;
+        delete []total;
+    }
+    size_t Cells() { return (size_t)ngrid*ngrid*ngrid; }
+
+    void Reset() {
+        // Clear the sums, for the next realization of a batch
+        memset(total, 0, Cells()*sizeof(long long));
+        for (int t=0;t<nthread;t++) memset(grid[t], 0, WindowCells()*sizeof(long long));
+        zlow = 0;
+    }
+    size_t WindowCells() { return (size_t)nwindow*ngrid*ngrid; }
+
+    static int WindowPlanes(Parameters& param) {
+        // Enough for the grid planes of a Z block, with the upper
+        // neighbours of the last, and a spill plane on either side
+        int ngrid = param.cic_grid;
+        int n = (int)ceil((double)(param.ppd/param.numblock)*ngrid/param.ppd)+4;
+        return n<ngrid ? n : ngrid;
+    }
+    static double Memory(Parameters& param, int nthread) {
+        double plane = (double)param.cic_grid*param.cic_grid*sizeof(long long);
+        return plane*(param.cic_grid+(double)nthread*WindowPlanes(param));
+    }
+
+    void StartBlock(int z) {
+        // Move the windows to the Z block starting at lattice plane z
+        if (ngrid==0) return;
+        Flush();
+        zlow = (int)floor((double)z*ngrid/param.ppd)-1;
+    }
+
+    void DepositPlane(int z, Complx *slab1, Complx *slab2, BlockArray& array) {
+        // Deposit the particles of plane z, from the transformed arrays
+        // (in the packing of LoadParticle).  Called by the computing threads.
+        if (ngrid==0) return;
+        long long *g = grid[omp_get_thread_num()];
+        double scale = ngrid/param.boxsize;     // Grid spacings per unit length
+        double lattice = (double)ngrid/array.ppd;
+        for (int y=0;y<array.ppd;y++)
+        for (int x=0;x<array.ppd;x++) {
+            double u[3] = { x*lattice+imag(YX(slab1,y,x))*scale,
+                            y*lattice+real(YX(slab2,y,x))*scale,
+                            z*lattice+imag(YX(slab2,y,x))*scale };
+            int c[3][2];
+            double w[3][2];
+            for (int i=0;i<3;i++) {
+                double f = floor(u[i]);
+                int c0 = ((long long)f%ngrid+ngrid)%ngrid;
+                c[i][0] = c0; c[i][1] = c0+1<ngrid ? c0+1 : 0;
+                w[i][1] = u[i]-f; w[i][0] = 1.0-w[i][1];
+            }
+            for (int k=0;k<2;k++) {
+                int zw = ((c[2][k]-zlow)%ngrid+ngrid)%ngrid;
+                for (int j=0;j<2;j++) {
+                    double wzy = w[2][k]*w[1][j];
+                    long long w0 = llrint(wzy*w[0][0]*CIC_ONE), w1 = llrint(wzy*w[0][1]*CIC_ONE);
+                    if (zw<nwindow) {
+                        long long *row = g+(size_t)ngrid*(c[1][j]+(size_t)ngrid*zw);
+                        row[c[0][0]] += w0;
+                        row[c[0][1]] += w1;
+                    } else {
+                        long long *row = total+(size_t)ngrid*(c[1][j]+(size_t)ngrid*c[2][k]);
+                        #pragma omp atomic
+                        row[c[0][0]] += w0;
+                        #pragma omp atomic
+                        row[c[0][1]] += w1;
+                    }
+                }
+            }
+        }
+    }
+
+    void Flush() {
+        // Add the windows of the threads to the grid, and clear them
+        if (nthread==0) return;
+        size_t nplane = (size_t)ngrid*ngrid;
+        #pragma omp parallel for schedule(static)
+        for (long long j=0;j<(long long)WindowCells();j++) {
+            int zw = j/nplane;
+            long long *dest = total+(size_t)((zlow+zw)%ngrid+ngrid)%ngrid*nplane+j%nplane;
+            for (int t=0;t<nthread;t++) { *dest += grid[t][j]; grid[t][j] = 0; }
+        }
+    }
+
+    void WritePartial(int zstart, int zend) {
+        // Save the sums of an XY range job, for the finalize stage
+        if (ngrid==0) return;
+        Flush();
+        char fn[1100];
+        sprintf(fn, "%s/zeldovich.cic.%d.%d", param.output_dir, zstart, zend);
+        FILE *fp = fopen(fn, "wb");
+        assert(fp!=NULL);
+        int ok = fwrite(total, sizeof(long long), Cells(), fp)==Cells();
+        ok = fclose(fp)==0 && ok;
+        if (!ok) {
+            fprintf(stderr,"Error: could not write %s\n",fn);
+            exit(1);
+        }
+    }
+
+    int Merge(const std::vector<std::pair<int,int> >& ranges) {
+        // Add up the sums of the XY range jobs, whose Z block ranges have
+        // been checked to cover every block once.  Return the number of
+        // jobs, or -1 if only some of them saved their sums.
+        if (ngrid==0) return 0;
+        char fn[1100];
+        int njob = 0;
+        long long *in = new long long[Cells()];
+        for (size_t r=0;r<ranges.size();r++) {
+            sprintf(fn,"%s/zeldovich.cic.%d.%d",param.output_dir,ranges[r].first,ranges[r].second);
+            FILE *fp = fopen(fn,"rb");
+            if (fp==NULL) continue;
+            if (fread(in, sizeof(long long), Cells(), fp)!=Cells()) {
+                fprintf(stderr,"Error: could not read %s; is ZD_CICGrid the same?\n",fn);
+                exit(1);
+            }
+            fclose(fp);
+            for (size_t j=0;j<Cells();j++) total[j] += in[j];
+            njob++;
+        }
+        delete []in;
+        if (njob>0 && njob<(int)ranges.size()) {
+            fprintf(stderr,"Error: only %d of the %d XY jobs saved their CIC density.\n",njob,(int)ranges.size());
+            return -1;
+        }
+        return njob;
+    }
+
+    void Write() {
+        // Write the density contrast, as floats in (z,y,x) order after the
+        // parameter file header, to ZD_CIC_filename
+        if (ngrid==0) return;
+        Flush();
+        FILE *fp = fopen(param.cic_filename, "wb");
+        if (fp==NULL) {
+            fprintf(stderr,"Error: could not open %s: %s\n",param.cic_filename,strerror(errno));
+            exit(1);
+        }
+        if (param.qnoheader==0) param.print(fp,"zeldovich_1float");
+        double mean = CUBE((double)param.ppd/ngrid)*CIC_ONE;
+        float *row = new float[ngrid];
+        int ok = 1;
+        for (size_t j=0;j<Cells();j+=ngrid) {
+            for (int x=0;x<ngrid;x++) row[x] = total[j+x]/mean-1.0;
+            ok = ok && fwrite(row, sizeof(float), ngrid, fp)==(size_t)ngrid;
+        }
+        ok = fclose(fp)==0 && ok;
+        if (!ok) {
+            fprintf(stderr,"Error: could not write %s\n",param.cic_filename);
+            exit(1);
+        }
+        delete []row;
+        printf("Wrote the %d^3 CIC density to %s.\n", ngrid, param.cic_filename);
+    }
+};
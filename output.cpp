@@ -2,6 +2,7 @@
 // CountCell *cic;
 
 double density_variance;
+double max_quant_err[2];    // Largest quantization error in displacement, velocity
 #define YX(_slab,_y,_x) _slab[(_x)+array.ppd*(_y)]
 
 #define WRAP(_x) if (_x<0.0) _x += param.boxsize; \
@@ -23,13 +24,50 @@ public:
     double displ[3];
     double vel[3];
 };
+// The quantized format starts each plane with a header giving the plane
+// and the scales; the lattice location of each particle is implied by
+// its place in the plane, in (y,x) order.
+class RVQuantZelPlaneHeader {
+public:
+    int z, ppd;
+    float displscale, velscale;   // Multiply the stored integers by these
+};
+class RVQuantZelParticle {
+public:
+    short displ[3];
+    short vel[3];
+};
+// The columnar format holds the planes [zfirst,zfirst+nplanes) of the
+// lattice as six float arrays, displ[3] then vel[3] in (z,y,x) order,
+// each of nplanes*ppd^2 particles in (z,y,x) lattice order.
+// The header is padded to 4096 bytes, so that the columns are aligned.
+class RVZelColumnsHeader {
+public:
+    char magic[8];      // "ZDCOLS1"
+    int ppd;
+    int zfirst, nplanes;
+    int ncolumn;
+};
 
-void WriteParticlesSlab(FILE *output, FILE *densoutput, 
-int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
-BlockArray& array, Parameters& param) {
-    // Write out one slab of particles
-    int x,y;
-    double pos[4], vel[3];
+// Fill one output particle.  Note that the output is in (z,y,x) order.
+inline void SetParticle(ZelParticle &out, int z, int y, int x, double *pos, double *vel) {
+    out.i = z; out.j =y; out.k = x;
+    out.displ[0] = pos[2]; out.displ[1] = pos[1]; out.displ[2] = pos[0];
+}
+inline void SetParticle(RVZelParticle &out, int z, int y, int x, double *pos, double *vel) {
+    out.i = z; out.j =y; out.k = x;
+    out.displ[0] = pos[2]; out.displ[1] = pos[1]; out.displ[2] = pos[0];
+    out.vel[0] = vel[2]; out.vel[1] = vel[1]; out.vel[2] = vel[0];
+}
+inline void SetParticle(RVdoubleZelParticle &out, int z, int y, int x, double *pos, double *vel) {
+    out.i = z; out.j =y; out.k = x;
+    out.displ[0] = pos[2]; out.displ[1] = pos[1]; out.displ[2] = pos[0];
+    out.vel[0] = vel[2]; out.vel[1] = vel[1]; out.vel[2] = vel[0];
+}
+
+inline void LoadParticle(int y, int x, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
+BlockArray& array, Parameters& param, double *pos, double *vel) {
+    // Pull the displacement, density, and velocity of one particle out of the FFTs.
     double norm, densitynorm, vnorm;
     // We also need to fix the normalizations, which come from many places:
     // 1) We used ik/k^2 to apply the velocities.
@@ -43,79 +81,1413 @@ BlockArray& array, Parameters& param) {
     norm = 1.0; densitynorm = 1.0; vnorm = 1.0;
     //norm = 1e-2;
 
-    char fn[1080];
-    sprintf(fn, "%s/ic_%d",param.output_dir,z*param.cpd/param.ppd);
-    //printf("z: %d goes goes to ic_%d /n", z, z*param.cpd/param.ppd);
-    output = fopen(fn,"ab");
-
-    for (y=0;y<array.ppd;y++)
-    for (x=0;x<array.ppd;x++) {
-        // The displacements are in YX(slab,y,x) and the
-        // base positions are in z,y,x
-        //       pos[0] = x*param.separation+imag(YX(slab1,y,x))*norm;
-        //       pos[1] = y*param.separation+real(YX(slab2,y,x))*norm;
-        //       pos[2] = z*param.separation+imag(YX(slab2,y,x))*norm;
-        pos[0] = imag(YX(slab1,y,x))*norm;
-        pos[1] = real(YX(slab2,y,x))*norm;
-        pos[2] = imag(YX(slab2,y,x))*norm;
-        pos[3] = real(YX(slab1,y,x))*densitynorm;
-        if(param.qPLT){
-            vel[0] = imag(YX(slab3,y,x))*vnorm;
-            vel[1] = real(YX(slab4,y,x))*vnorm;
-            vel[2] = imag(YX(slab4,y,x))*vnorm;
-        } else {
-            vel[0] = imag(YX(slab1,y,x))*vnorm;
-            vel[1] = real(YX(slab2,y,x))*vnorm;
-            vel[2] = imag(YX(slab2,y,x))*vnorm;
-            //vel[0] = 0; vel[1] = 0;vel[2] = 0;
-        }
-        //            WRAP(pos[0]);
-        //            WRAP(pos[1]);
-        //            WRAP(pos[2]);
-        if (param.qascii) {
-            fprintf(output,"%d %d %d %f %f %f %f %f %f %f\n",x,y,z,pos[0],pos[1],pos[2],pos[3], vel[0], vel[1], vel[2]);
-        } else {
-            if(strcmp(param.ICFormat, "RVdoubleZel") == 0){
-                RVdoubleZelParticle out;
-                out.i = z; out.j =y; out.k = x;
-                out.displ[0] = pos[2]; out.displ[1] = pos[1]; out.displ[2] = pos[0];
-                out.vel[0] = vel[2]; out.vel[1] = vel[1]; out.vel[2] = vel[0];
-                fwrite(&out,sizeof(out),1,output);
-            } else if (strcmp(param.ICFormat, "RVZel") == 0){
-                RVZelParticle out;
-                out.i = z; out.j =y; out.k = x;
-                out.displ[0] = pos[2]; out.displ[1] = pos[1]; out.displ[2] = pos[0];
-                out.vel[0] = vel[2]; out.vel[1] = vel[1]; out.vel[2] = vel[0];
-                fwrite(&out,sizeof(out),1,output);
-            } else if (strcmp(param.ICFormat, "Zeldovich") == 0){
-                ZelParticle out;
-                out.i = z; out.j =y; out.k = x;
-                out.displ[0] = pos[2]; out.displ[1] = pos[1]; out.displ[2] = pos[0];
-                fwrite(&out,sizeof(ZelParticle),1,output);
-            }
-            else {
-                fprintf(stderr, "Error: unknown ICFormat \"%s\". Aborting.\n", param.ICFormat);
-                exit(1);
-            }
-            //           fwrite(vel,sizeof(float),3,output);
-            //           int *id;
-            //           id = new int;
-            //           *id = x+(y*param.ppd)+(z*param.ppd*param.ppd);
-            //           if (*id <0) std::cout <<"Bad id: "<<*id<<"\n";
-            //           fwrite(id,sizeof(int),1,output);
-            //           fwrite(id,sizeof(int),1,output);
-            //           if (densoutput!=NULL) fwrite(pos+3,sizeof(float),1,densoutput);
-            //           delete id;
-        }
+    // The displacements are in YX(slab,y,x) and the
+    // base positions are in z,y,x
+    //       pos[0] = x*param.separation+imag(YX(slab1,y,x))*norm;
+    //       pos[1] = y*param.separation+real(YX(slab2,y,x))*norm;
+    //       pos[2] = z*param.separation+imag(YX(slab2,y,x))*norm;
+    pos[0] = imag(YX(slab1,y,x))*norm;
+    pos[1] = real(YX(slab2,y,x))*norm;
+    pos[2] = imag(YX(slab2,y,x))*norm;
+    pos[3] = real(YX(slab1,y,x))*densitynorm;
+    if(param.qPLT || param.q2LPT){
+        vel[0] = imag(YX(slab3,y,x))*vnorm;
+        vel[1] = real(YX(slab4,y,x))*vnorm;
+        vel[2] = imag(YX(slab4,y,x))*vnorm;
+    } else {
+        vel[0] = imag(YX(slab1,y,x))*vnorm;
+        vel[1] = real(YX(slab2,y,x))*vnorm;
+        vel[2] = imag(YX(slab2,y,x))*vnorm;
+        //vel[0] = 0; vel[1] = 0;vel[2] = 0;
+    }
+    //            WRAP(pos[0]);
+    //            WRAP(pos[1]);
+    //            WRAP(pos[2]);
+}
+
+class PlaneStats {
+    // The reductions over the particles of one plane.  Each plane is
+    // converted by one thread; the planes are then combined in z order,
+    // so that the totals don't depend on the number of threads.
+public:
+    double density_variance;
+    double max_disp[3];
+    double quant_err[2];
+    PlaneStats() {
+        density_variance = 0.0;
+        for (int i=0;i<3;i++) max_disp[i] = 0.0;
+        quant_err[0] = quant_err[1] = 0.0;
+    }
+
+    inline void Accumulate(double *pos) {
         density_variance += pos[3]*pos[3];
-        
-        // Track the global max displacement
+
+        // Track the max displacement
         for(int i = 0; i < 3; i++){
             max_disp[i] = pos[i] > max_disp[i] ? pos[i] : max_disp[i];
         }
 
         // cic->add_cic(param.boxsize,pos);
     }
-    fclose(output);
-    return;
-}
\ No newline at end of file
+
+    void AddToGlobals() {
+        ::density_variance += density_variance;
+        for(int i = 0; i < 3; i++){
+            ::max_disp[i] = max_disp[i] > ::max_disp[i] ? max_disp[i] : ::max_disp[i];
+        }
+        for(int i = 0; i < 2; i++){
+            max_quant_err[i] = quant_err[i] > max_quant_err[i] ? quant_err[i] : max_quant_err[i];
+        }
+    }
+};
+
+// ===============================================================
+
+#define MAXCOLUMN 8
+
+class ParticleWriter {
+    // Writes the particles of each z plane to the output file holding it;
+    // by default, the ic_ file of its slab.
+    // The ICFormat is resolved once, into a derived class that converts
+    // a whole plane into a buffer, which is then written at once.
+    // Planes may be converted concurrently, each into its own buffer,
+    // but must be queued in z order.
+    //
+    // The buffers come from a fixed pool.  Queued buffers are written
+    // by background threads and then returned to the pool, so that the
+    // writes overlap with the computation of the next planes.
+    // When the pool is empty, the computation waits.
+    //
+    // For formats with a fixed size per plane, each file is preallocated
+    // and every plane is written with pwrite() at its own offset, so the
+    // planes may be written by any thread in any order, and rewriting a
+    // plane is harmless.  Otherwise, the planes are placed one after the
+    // other, from the end of the existing file, in the order queued.
+    //
+    // A format may also split the file into columns, each holding its
+    // part of every plane, after a header of its own.  The buffer then
+    // holds the plane's part of each column in turn.
+    //
+    // With ZD_qmanifest, every piece written is hashed, and once all of a
+    // file is written (by this run and any other XY jobs sharing it), it
+    // is marked complete with its size and digest in the manifest
+    // directory, so that the files can be read while later ones are made.
+    // The list of its pieces goes alongside, to check the file against.
+    // The planes are hashed by the threads that convert them.
+    //
+    // A format that bins the particles by final position puts those of
+    // each plane that have left the slab at the end of its buffer, for
+    // the files of the slabs below and above.  Every file then stays open
+    // until the planes of both neighbouring slabs are written.
+    //
+    // A format may also sort each complete file by cell, when it is
+    // closed.  Such a file must be written by a single run.
+    //
+    // With ZD_Compress, each plane is compressed as one zstd frame by the
+    // thread that converted it, so the planes are compressed in parallel,
+    // and the frames are appended as for a format of variable size.
+    // Each file ends with a seek table of its frames, in the zstd seekable
+    // format, so that a reader can go straight to any plane.
+public:
+    Parameters& param;
+    size_t planebytes;  // Bytes per plane, or 0 if variable
+    int ncolumn;        // The number of columns in each file
+    size_t colbytes[MAXCOLUMN];   // Bytes per plane in each column
+    size_t headerbytes; // The size of the file header before the columns
+    int shareable;      // Non-zero if separate jobs may write one file
+    int binning;        // Non-zero if planes spill into the neighbouring files
+    int cellsort;       // Non-zero if complete files are sorted by cell
+    size_t (*spillbytes)[2];    // For each plane, the bytes for the files below and above
+    int nfile;          // The number of output files
+    int planes_per_file;    // 0 to split by ic_ slab
+    int qmanifest;      // Non-zero to hash the writes and mark complete files
+    int qhashplanes;    // Non-zero if the planes are hashed as they are converted
+    int compressing;    // Non-zero if the planes are written as zstd frames
+#ifdef ZSTD
+    ZSTD_CCtx **cctx;   // A compression context for each computing thread
+    char **scratch;     // And a buffer to compress into
+    size_t scratchbytes;
+#endif
+    size_t *rawbytes;   // For each plane, its size before compression
+    double *compresstime;   // And the seconds taken to compress it
+    double total_raw, total_compressed, total_seconds;
+    unsigned long long fingerprint;   // Hash of the parameter file
+    char output_dir[1024];  // Where the files go; InitialConditionsDirectory when made
+    char manifest_dir[1100];
+    size_t buffersize;
+    int nbuffer;        // Size of the buffer pool
+    char **pool;        // The free buffers
+    int nfree;
+    int nwriter;
+    pthread_t *threads;
+    struct WriteJob {
+        int file, z;
+        off_t offset;       // Where the plane goes, if appending
+        char *buffer;
+        size_t nbytes;
+        unsigned long long hash[MAXCOLUMN];     // Of each column's part, if hashed
+        struct {
+            int file, fd;
+            off_t offset;
+            size_t start, nbytes;   // The part of the buffer for this file
+        } spill[2];     // The particles leaving the slab, if binning
+    } *jobs;
+    int head, njob;     // A ring of queued jobs
+    int nbusy;          // The number of jobs being written
+    int stopping;
+    struct OutputFile {
+        int fd;
+        int planes_remaining;   // Planes of this run still to be written
+        off_t next;             // Where the next plane goes, if appending
+        std::vector<OutputPiece> pieces;    // What this run wrote, if hashing
+        off_t start;            // The size of the file when opened, if appending
+        std::vector<std::pair<unsigned int,unsigned int> > frames;   // Compressed and raw bytes, if compressing
+        double raw, compressed, seconds;    // What this run compressed, to what, and the time taken
+    } *files;
+    int zlo, zhi;       // The planes [zlo,zhi) of this run
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t piecelock;  // Guards the lists of pieces
+
+    ParticleWriter(Parameters& _param, size_t _planebytes, size_t _buffersize): param(_param) {
+        planebytes = _planebytes;
+        ncolumn = 1;
+        colbytes[0] = planebytes;
+        headerbytes = 0;
+        shareable = planebytes>0;
+        binning = 0;
+        cellsort = 0;
+        spillbytes = NULL;
+        nfile = param.cpd;
+        planes_per_file = 0;
+        qmanifest = qhashplanes = param.qmanifest;
+        compressing = 0;
+        rawbytes = NULL;
+        compresstime = NULL;
+        total_raw = total_compressed = total_seconds = 0.0;
+        fingerprint = xxh64(param.inputstream->buffer, param.inputstream->bufferlength, 0);
+        strcpy(output_dir, param.output_dir);
+        sprintf(manifest_dir, "%s/manifest", output_dir);
+        buffersize = _buffersize;
+        files = NULL;
+        // Each computing thread holds at most one buffer at a time,
+        // so we need at least one more to be able to make progress.
+        int nthread = omp_get_max_threads();
+        nbuffer = param.write_buffers>0 ? param.write_buffers : 2*nthread;
+        if (nbuffer<nthread+1) {
+            fprintf(stderr,"Warning: raising ZD_WriteBuffers from %d to %d, one more than the number of threads.\n",
+                nbuffer, nthread+1);
+            nbuffer = nthread+1;
+        }
+        pool = NULL;
+        jobs = new WriteJob[nbuffer];
+        head = njob = nbusy = 0;
+        SetRange(0,param.ppd);
+        pthread_mutex_init(&lock,NULL);
+        pthread_cond_init(&cond,NULL);
+        pthread_mutex_init(&piecelock,NULL);
+        stopping = 0;
+        nwriter = param.num_writers>0 ? param.num_writers : 1;
+        threads = NULL;
+    }
+    virtual ~ParticleWriter() {
+        if (threads!=NULL) {
+            Close();
+            pthread_mutex_lock(&lock);
+            stopping = 1;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&lock);
+            for (int w=0;w<nwriter;w++) pthread_join(threads[w],NULL);
+            delete []threads;
+            assert(nfree==nbuffer);
+            for (int j=0;j<nbuffer;j++) free(pool[j]);
+            delete []pool;
+        }
+        delete []jobs;
+        delete []files;
+        delete []spillbytes;
+#ifdef ZSTD
+        if (compressing) {
+            int nthread = omp_get_max_threads();
+            for (int t=0;t<nthread;t++) { ZSTD_freeCCtx(cctx[t]); delete []scratch[t]; }
+            delete []cctx;
+            delete []scratch;
+        }
+#endif
+        delete []rawbytes;
+        delete []compresstime;
+        pthread_mutex_destroy(&lock);
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&piecelock);
+    }
+
+    void Start() {
+        // Allocate the buffers and start the writers, once the derived
+        // class has set up the layout.
+        if (param.compress_level>0) StartCompression();
+        pool = new char *[nbuffer];
+        for (nfree=0;nfree<nbuffer;nfree++) {
+            int ret = posix_memalign((void **)&pool[nfree], 4096, buffersize);
+            assert(ret==0);
+            memset(pool[nfree],0,buffersize);   // So that struct padding is written as zeros
+        }
+        files = new OutputFile[nfile];
+        for (int f=0;f<nfile;f++) files[f].fd = -1;
+        StartFiles();
+        threads = new pthread_t[nwriter];
+        for (int w=0;w<nwriter;w++) {
+            int ret = pthread_create(&threads[w],NULL,WriterMain,this);
+            assert(ret==0);
+        }
+    }
+
+    void StartFiles() {
+        // List the files and make the manifest directory, for a new run
+        if (!binning) WriteFileIndex();
+        if (qmanifest && mkdir(manifest_dir, 0755)!=0 && errno!=EEXIST) {
+            fprintf(stderr,"Error: could not make %s: %s\n",manifest_dir,strerror(errno));
+            exit(1);
+        }
+    }
+
+    virtual void Reset(const char *dir) {
+        // Start over in dir, for the next realization of a batch, keeping
+        // the buffers and the writer threads.  Call after Close().
+        pthread_mutex_lock(&lock);
+        assert(njob==0 && nbusy==0 && nfree==nbuffer);
+        for (int f=0;f<nfile;f++) {
+            OutputFile &file = files[f];
+            assert(file.fd<0);
+            file.pieces.clear();
+            file.frames.clear();
+            file.raw = file.compressed = file.seconds = 0.0;
+        }
+        total_raw = total_compressed = total_seconds = 0.0;
+        strcpy(output_dir, dir);
+        sprintf(manifest_dir, "%s/manifest", output_dir);
+        pthread_mutex_unlock(&lock);
+        SetRange(0,param.ppd);
+        StartFiles();
+    }
+
+    void StartCompression() {
+        // Switch to writing each plane as a zstd frame, appended in turn
+#ifdef ZSTD
+        if (ncolumn>1 || headerbytes>0 || binning || cellsort) {
+            fprintf(stderr,"Error: ZD_Compress needs a format that stores one plane after another, not %s, and not with ZD_qfinalslab or ZD_qcellsort.\n",
+                param.ICFormat);
+            exit(1);
+        }
+        if (buffersize>0xffffffffull) {
+            fprintf(stderr,"Error: ZD_Compress needs z planes of under 4 GB.\n");
+            exit(1);
+        }
+        compressing = 1;
+        planebytes = colbytes[0] = 0;
+        shareable = 0;
+        // A frame may be a little larger than the plane, if it doesn't compress
+        buffersize = ZSTD_compressBound(buffersize);
+        int nthread = omp_get_max_threads();
+        cctx = new ZSTD_CCtx *[nthread];
+        scratch = new char *[nthread];
+        scratchbytes = nthread*buffersize;
+        for (int t=0;t<nthread;t++) {
+            cctx[t] = ZSTD_createCCtx();
+            assert(cctx[t]!=NULL);
+            ZSTD_CCtx_setParameter(cctx[t], ZSTD_c_compressionLevel, param.compress_level);
+            ZSTD_CCtx_setParameter(cctx[t], ZSTD_c_checksumFlag, 1);
+            scratch[t] = new char[buffersize];
+        }
+        rawbytes = new size_t[param.ppd];
+        compresstime = new double[param.ppd];
+#else
+        fprintf(stderr,"Error: ZD_Compress needs a build with -DZSTD.\n");
+        exit(1);
+#endif
+    }
+
+    // The memory that each writer thread needs to sort a file by cell
+    virtual double SortMemory() { return 0.0; }
+
+    double BufferMemory() {
+#ifdef ZSTD
+        if (compressing) return (double)nbuffer*buffersize+scratchbytes;
+#endif
+        return (double)nbuffer*buffersize;
+    }
+
+    void ChunkFiles() {
+        // Split the output into files of ZD_ParticlesPerFile particles or
+        // ZD_FileBytes bytes, rounded down to whole z planes, rather than
+        // by slab.  For formats of a fixed size per plane; the derived
+        // constructor calls this once the layout is set.
+        if (param.particles_per_file>0) planes_per_file = param.particles_per_file/(1ll*param.ppd*param.ppd);
+        else if (param.file_bytes>0) planes_per_file = param.file_bytes/(long long)planebytes;
+        else return;
+        if (planes_per_file<1) planes_per_file = 1;
+        nfile = (param.ppd+planes_per_file-1)/planes_per_file;
+    }
+
+    // The mapping of planes to files.  By default, this is the ic_ file
+    // of the slab.
+    virtual int FileOf(int z) {
+        if (planes_per_file>0) return z/planes_per_file;
+        return 1ll*z*param.cpd/param.ppd;
+    }
+    virtual int FirstPlane(int file) {
+        // The first z plane that goes into file
+        if (planes_per_file>0) return file*planes_per_file<param.ppd ? file*planes_per_file : param.ppd;
+        return (1ll*file*param.ppd+param.cpd-1)/param.cpd;
+    }
+    virtual void FileName(int file, char *fn) {
+        if (planes_per_file>0) sprintf(fn, "%s/ic_chunk.%d",output_dir,file);
+        else sprintf(fn, "%s/ic_%d",output_dir,file);
+        if (compressing) strcat(fn, ".zst");
+    }
+
+    void WriteFileIndex() {
+        // List the z planes [zfirst,znext) of each output file, and its size
+        // if known, in zeldovich.fileindex
+        char fn[1100], tmp[1150], name[1080];
+        sprintf(fn, "%s/zeldovich.fileindex", output_dir);
+        sprintf(tmp, "%s.tmp.%d", fn, (int)getpid());
+        FILE *fp = fopen(tmp, "w");
+        assert(fp!=NULL);
+        fprintf(fp, "# file zfirst znext bytes name\n");
+        for (int f=0;f<nfile;f++) {
+            int first = FirstPlane(f), last = FirstPlane(f+1);
+            FileName(f, name);
+            const char *base = strrchr(name,'/');
+            fprintf(fp, "%d %d %d %lld %s\n", f, first, last,
+                planebytes>0 ? (long long)FileBytes(last-first) : -1ll, base!=NULL?base+1:name);
+        }
+        int ok = fclose(fp)==0 && rename(tmp, fn)==0;
+        assert(ok);
+    }
+    int Neighbours(int z, int *file) {
+        // The files that plane z writes to: its own, then, if binning, those
+        // of the slabs below and above.  Return the number of distinct files.
+        int s = FileOf(z), n = 1;
+        file[0] = s;
+        if (binning) {
+            int below = (s+nfile-1)%nfile, above = (s+1)%nfile;
+            if (below!=s) file[n++] = below;
+            if (above!=s && above!=below) file[n++] = above;
+        }
+        return n;
+    }
+    int PlanesFor(int file) {
+        // The number of planes of this run that write to file.  These are
+        // its own, and, if binning, those of its neighbours.
+        int slab[3], n = 0;
+        int nslab = Neighbours(FirstPlane(file), slab);
+        for (int j=0;j<nslab;j++) {
+            int first = FirstPlane(slab[j]), last = FirstPlane(slab[j]+1);
+            if (first<zlo) first = zlo;
+            if (last>zhi) last = zhi;
+            if (last>first) n += last-first;
+        }
+        return n;
+    }
+    int StartsFile(int z) {
+        // Return 1 if plane z is the first of a file (or the end of the lattice)
+        return z==0 || z==param.ppd || FileOf(z-1)!=FileOf(z);
+    }
+
+    // The layout of a file of nplanes planes, for a fixed size per plane
+    virtual off_t ColumnStart(int nplanes, int c) {
+        off_t start = headerbytes;
+        for (int j=0;j<c;j++) start += (off_t)nplanes*colbytes[j];
+        return start;
+    }
+    virtual off_t FileBytes(int nplanes) { return headerbytes+(off_t)nplanes*planebytes; }
+    // Write the file header and anything else outside of the columns
+    virtual void WriteFileHeader(int fd, int file, int first, int last) { }
+
+    void SetRange(int _zlo, int _zhi) {
+        // Declare the planes [zlo,zhi) that this run will write, so that
+        // we know when each file is complete.
+        zlo = _zlo; zhi = _zhi;
+        if (param.qoneslab>=0) {
+            if (zlo<param.qoneslab) zlo = param.qoneslab;
+            if (zhi>param.qoneslab+1) zhi = param.qoneslab+1;
+        }
+    }
+
+    char *GetBuffer() {
+        // Take a buffer from the pool, waiting for the writers if need be
+        pthread_mutex_lock(&lock);
+        while (nfree==0) pthread_cond_wait(&cond,&lock);
+        char *buffer = pool[--nfree];
+        pthread_mutex_unlock(&lock);
+        return buffer;
+    }
+
+    // Convert plane z into buffer and return the number of bytes used
+    virtual size_t ConvertPlane(int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
+        BlockArray& array, char *buffer, PlaneStats& stats) = 0;
+
+    size_t CompressPlane(int z, char *buffer, size_t nbytes) {
+        // Compress a converted plane in place, as one zstd frame, and
+        // return its new size
+        if (!compressing) return nbytes;
+#ifdef ZSTD
+        int t = omp_get_thread_num();
+        double start = omp_get_wtime();
+        size_t csize = ZSTD_compress2(cctx[t], scratch[t], buffersize, buffer, nbytes);
+        if (ZSTD_isError(csize)) {
+            fprintf(stderr,"Error: compressing plane %d failed: %s\n",z,ZSTD_getErrorName(csize));
+            exit(1);
+        }
+        memcpy(buffer, scratch[t], csize);
+        rawbytes[z] = nbytes;
+        compresstime[z] = omp_get_wtime()-start;
+        return csize;
+#else
+        return nbytes;
+#endif
+    }
+
+    void HashPlane(int z, const char *buffer, size_t nbytes, unsigned long long *hash) {
+        // Hash each column's part of a converted plane, while it is in cache.
+        // Any spills are hashed as they are written.
+        if (!qhashplanes) return;
+        if (binning) nbytes -= spillbytes[z][0]+spillbytes[z][1];
+        if (planebytes==0) { hash[0] = xxh64(buffer,nbytes,0); return; }
+        for (int c=0;c<ncolumn;c++) {
+            hash[c] = xxh64(buffer,colbytes[c],0);
+            buffer += colbytes[c];
+        }
+    }
+
+    void WritePlane(int z, char *buffer, size_t nbytes, const unsigned long long *hash) {
+        // Queue the buffer, with its hashes, for writing.
+        // It returns to the pool afterwards.
+        int file[3], nf = Neighbours(z, file);
+        pthread_mutex_lock(&lock);
+        for (int j=0;j<nf;j++) {
+            OutputFile &f = files[file[j]];
+            if (f.fd>=0) continue;
+            OpenFile(file[j], FirstPlane(file[j]), FirstPlane(file[j]+1));
+            f.planes_remaining = PlanesFor(file[j]);
+        }
+        assert(njob<nbuffer);
+        WriteJob &job = jobs[(head+njob)%nbuffer];
+        job.file = file[0]; job.z = z; job.buffer = buffer; job.nbytes = nbytes;
+        if (qhashplanes) memcpy(job.hash, hash, sizeof(job.hash));
+        for (int k=0;k<2;k++) {
+            job.spill[k].nbytes = binning ? spillbytes[z][k] : 0;
+            if (job.spill[k].nbytes==0) continue;
+            OutputFile &f = files[job.spill[k].file = (file[0]+(k?1:nfile-1))%nfile];
+            job.nbytes -= job.spill[k].nbytes;
+            job.spill[k].offset = f.next; f.next += job.spill[k].nbytes;
+        }
+        job.spill[0].start = job.nbytes;
+        job.spill[1].start = job.nbytes+job.spill[0].nbytes;
+        if (planebytes==0) { job.offset = files[file[0]].next; files[file[0]].next += job.nbytes; }
+        if (compressing) {
+            OutputFile &f = files[file[0]];
+            f.frames.push_back(std::make_pair((unsigned int)nbytes, (unsigned int)rawbytes[z]));
+            f.raw += rawbytes[z];
+            f.compressed += nbytes;
+            f.seconds += compresstime[z];
+        }
+        njob++;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    // Report anything particular to the format at the end of the XY pass
+    virtual void Summary() { }
+
+    void ReportCompression() {
+        if (!compressing || total_raw==0.0) return;
+        double gb = 1024.0*1024.0*1024.0;
+        printf("Compressed %f GB to %f GB (ratio %.3f), at %.1f MB/s per thread.\n",
+            total_raw/gb, total_compressed/gb, total_raw/total_compressed,
+            total_seconds>0 ? total_raw/total_seconds/1e6 : 0.0);
+    }
+
+    void Flush() {
+        // Wait until everything queued so far is written
+        pthread_mutex_lock(&lock);
+        while (njob>0||nbusy>0) pthread_cond_wait(&cond,&lock);
+        pthread_mutex_unlock(&lock);
+    }
+
+    void Close() {
+        // Finish the writes and close any files left open
+        Flush();
+        pthread_mutex_lock(&lock);
+        for (int f=0;f<nfile;f++)
+            if (files[f].fd>=0) CloseFile(f);
+        pthread_mutex_unlock(&lock);
+    }
+
+    void SavePieces() {
+        // Save what we know of the files still open, so that a rerun
+        // after a failure can complete their digests.  Call after Flush().
+        if (!qmanifest) return;
+        pthread_mutex_lock(&lock);
+        for (int f=0;f<nfile;f++)
+            if (files[f].fd>=0 && files[f].pieces.size()>0) SavePieces(f);
+        pthread_mutex_unlock(&lock);
+    }
+
+protected:
+    virtual void OpenFile(int file, int first, int last) {
+        // Open the file, preallocating it if we know its size.
+        // Called with the lock held.
+        char fn[1080];
+        OutputFile &f = files[file];
+        FileName(file, fn);
+        if (qmanifest) Unmark(file);
+        // Sorting binned particles, or listing the frames of an old
+        // compressed file, reads it back.  The particles are sorted with
+        // the cell counts of this run, so a file to sort starts afresh.
+        int flags = binning&&cellsort ? O_RDWR|O_TRUNC : compressing ? O_RDWR : O_WRONLY;
+        f.fd = open(fn, flags|O_CREAT, 0644);
+        if (f.fd<0) {
+            fprintf(stderr,"Error: could not open %s: %s\n",fn,strerror(errno));
+            exit(1);
+        }
+        if (planebytes>0) {
+            off_t size = FileBytes(last-first);
+            // Reserve the space where the filesystem supports it.
+            // The size is set either way, which also cuts any longer old file.
+            fallocate(f.fd, 0, 0, size);
+            int ret = ftruncate(f.fd, size);
+            assert(ret==0);
+            WriteFileHeader(f.fd, file, first, last);
+        } else f.start = f.next = lseek(f.fd, 0, SEEK_END);
+        f.frames.clear();
+        f.raw = f.compressed = f.seconds = 0.0;
+    }
+    virtual void CloseFile(int file) {
+        // Called with the lock held, once the file's writes are done
+        if (compressing) WriteSeekTable(file);
+        off_t size = lseek(files[file].fd, 0, SEEK_END);
+        if (cellsort && param.qoneslab<0) {
+            // The file is complete.  Nothing else touches it, so we
+            // let the other writers carry on while we sort it.
+            pthread_mutex_unlock(&lock);
+            SortFile(file, files[file].fd, size);
+            pthread_mutex_lock(&lock);
+        }
+        close(files[file].fd);
+        files[file].fd = -1;
+        if (qmanifest) FinishFile(file, size);
+    }
+
+    // Finish a complete file sorted by cell
+    virtual void SortFile(int file, int fd, off_t size) { }
+
+    void WriteSeekTable(int file) {
+        // End the file with the zstd seekable format's seek table: a
+        // skippable frame listing the compressed and raw size of each frame,
+        // then the number of frames, a descriptor byte, and a magic number.
+        // Called with the lock held.
+        OutputFile &f = files[file];
+#ifdef ZSTD
+        if (f.start>0) ScanFrames(file);
+#endif
+        size_t nframe = f.frames.size(), n = 0;
+        unsigned int *table = new unsigned int[2*nframe+5];
+        table[n++] = 0x184D2A5E;    // Skippable frame
+        table[n++] = 8*nframe+9;    // Its size
+        for (size_t j=0;j<nframe;j++) {
+            table[n++] = f.frames[j].first;
+            table[n++] = f.frames[j].second;
+        }
+        table[n++] = nframe;
+        // Then the descriptor byte (0, for no checksums in the table) and
+        // the seekable magic number, packed unaligned after it
+        unsigned char footer[5] = { 0, 0xB1, 0xEA, 0x92, 0x8F };
+        memcpy(table+n, footer, 5);
+        size_t nbytes = 4*n+5;
+        WritePiece(file, f.fd, (char *)table, nbytes, f.next);
+        f.next += nbytes;
+        delete []table;
+
+        double raw = 0.0;
+        for (size_t j=0;j<nframe;j++) raw += f.frames[j].second;
+        double compressed = f.next;
+        total_raw += f.raw;
+        total_compressed += f.compressed;
+        total_seconds += f.seconds;
+
+        // Report the file in zeldovich.compression
+        char fn[1100], name[1080];
+        sprintf(fn, "%s/zeldovich.compression", output_dir);
+        FileName(file, name);
+        const char *base = strrchr(name,'/');
+        FILE *fp = fopen(fn, "a");
+        assert(fp!=NULL);
+        if (ftell(fp)==0) fprintf(fp, "# file bytes raw_bytes ratio MB/s_per_thread name\n");
+        fprintf(fp, "%d %lld %lld %.4f %.1f %s\n", file, (long long)compressed, (long long)raw,
+            compressed>0 ? raw/compressed : 0.0, f.seconds>0 ? f.raw/f.seconds/1e6 : 0.0,
+            base!=NULL?base+1:name);
+        fclose(fp);
+    }
+
+#ifdef ZSTD
+    void ScanFrames(int file) {
+        // List the frames of a file that an earlier run began, by reading
+        // their headers back.  Any skippable frames (such as the seek table
+        // of an old file appended to) are listed too, with no raw bytes, so
+        // that the offsets still add up.
+        OutputFile &f = files[file];
+        std::vector<std::pair<unsigned int,unsigned int> > ours(f.frames);
+        f.frames.clear();
+        char *in = new char[buffersize];
+        for (off_t pos=0;pos<f.start;) {
+            size_t want = f.start-pos<(off_t)buffersize ? f.start-pos : buffersize;
+            ssize_t got = pread(f.fd, in, want, pos);
+            size_t fsize = got>0 ? ZSTD_findFrameCompressedSize(in, got) : 0;
+            if (got<=0 || ZSTD_isError(fsize)) {
+                fprintf(stderr,"Error: file %d does not hold whole zstd frames before byte %lld.\n",
+                    file, (long long)f.start);
+                exit(1);
+            }
+            unsigned int magic;
+            memcpy(&magic, in, 4);
+            unsigned long long raw = (magic&0xFFFFFFF0u)==0x184D2A50u ? 0 : ZSTD_getFrameContentSize(in, got);
+            f.frames.push_back(std::make_pair((unsigned int)fsize, (unsigned int)raw));
+            pos += fsize;
+        }
+        delete []in;
+        f.frames.insert(f.frames.end(), ours.begin(), ours.end());
+    }
+#endif
+
+    int FinalSlab(int lattice, double displ) {
+        // The slab (or cell row) holding a particle displaced by displ from
+        // lattice plane (or row) lattice.  We work in units of 1/cpd of the
+        // lattice spacing, so that undisplaced particles are placed exactly.
+        double u = (double)lattice*param.cpd+displ/param.separation*param.cpd;
+        int slab = (int)floor(u/param.ppd);
+        return (slab%param.cpd+param.cpd)%param.cpd;
+    }
+
+    int FirstRow(int cell) {
+        // The first lattice row (or column) of cell row (or column) cell
+        return (1ll*cell*param.ppd+param.cpd-1)/param.cpd;
+    }
+
+    void WriteCellIndex(int file, const long long *index) {
+        // The offset and count of each of the CPD^2 cells of a file sorted
+        // by cell, in particles, go in cellindex_<file>
+        int ncell = param.cpd*param.cpd;
+        char fn[1100];
+        sprintf(fn, "%s/cellindex_%d", output_dir, file);
+        FILE *fp = fopen(fn, "wb");
+        assert(fp!=NULL);
+        int ok = fwrite(index, sizeof(long long), 2*ncell, fp)==(size_t)2*ncell;
+        ok = fclose(fp)==0 && ok;
+        assert(ok);
+    }
+
+    void pwrite_all(int fd, const char *src, size_t nbytes, off_t offset) {
+        size_t done = 0;
+        while (done<nbytes) {
+            ssize_t ret = pwrite(fd, src+done, nbytes-done, offset+done);
+            if (ret<0 && errno==EINTR) continue;
+            if (ret<=0) {
+                fprintf(stderr,"Error: writing the output failed: %s\n",strerror(errno));
+                exit(1);
+            }
+            done += ret;
+        }
+    }
+
+    void WritePiece(int file, int fd, const char *src, size_t nbytes, off_t offset) {
+        // Write part of a file, and hash it if need be
+        pwrite_all(fd, src, nbytes, offset);
+        if (qmanifest) RecordPiece(file, offset, nbytes, xxh64(src,nbytes,0));
+    }
+    void WritePiece(int file, int fd, const char *src, size_t nbytes, off_t offset,
+            unsigned long long hash) {
+        // Write part of a plane that has already been hashed
+        pwrite_all(fd, src, nbytes, offset);
+        if (qmanifest) RecordPiece(file, offset, nbytes, hash);
+    }
+
+    void RecordPiece(int file, off_t offset, size_t nbytes, unsigned long long hash) {
+        OutputPiece piece = { (long long)offset, (long long)nbytes, hash };
+        pthread_mutex_lock(&piecelock);
+        files[file].pieces.push_back(piece);
+        pthread_mutex_unlock(&piecelock);
+    }
+
+    off_t HashFile(int file) {
+        // Hash a whole file that we could not hash as it was written,
+        // in pieces of 64 MB, and return its size
+        char fn[1080];
+        FileName(file, fn);
+        int fd = open(fn, O_RDONLY);
+        assert(fd>=0);
+        size_t chunk = 1<<26;
+        char *buffer = new char[chunk];
+        off_t size = 0;
+        ssize_t ret;
+        while ((ret=pread(fd, buffer, chunk, size))>0) {
+            RecordPiece(file, size, ret, xxh64(buffer,ret,0));
+            size += ret;
+        }
+        assert(ret==0);
+        delete []buffer;
+        close(fd);
+        return size;
+    }
+
+    // The bookkeeping of the manifest directory, which holds a marker for
+    // each complete file, and the pieces of incomplete ones, by job
+    void ManifestName(int file, const char *suffix, char *fn) {
+        char name[1080];
+        FileName(file, name);
+        const char *base = strrchr(name,'/');
+        sprintf(fn, "%s/%s%s", manifest_dir, base!=NULL?base+1:name, suffix);
+    }
+
+    void Unmark(int file) {
+        char fn[1200];
+        ManifestName(file, ".done", fn);
+        unlink(fn);
+        ManifestName(file, ".xxh", fn);
+        unlink(fn);
+    }
+
+    void SavePieces(int file) {
+        // Write our pieces of the file, replacing any we saved before
+        char fn[1200], tmp[1250], suffix[64], name[1080];
+        sprintf(suffix, ".pieces.%d.%d", zlo, zhi);
+        ManifestName(file, suffix, fn);
+        sprintf(tmp, "%s.tmp", fn);
+        FileName(file, name);
+        FILE *fp = fopen(tmp, "w");
+        assert(fp!=NULL);
+        pthread_mutex_lock(&piecelock);
+        std::vector<OutputPiece> &pieces = files[file].pieces;
+        fprintf(fp, "# %016llx %s\n", fingerprint, name);
+        for (size_t j=0;j<pieces.size();j++)
+            fprintf(fp, "%lld %lld %016llx\n", pieces[j].offset, pieces[j].nbytes, pieces[j].hash);
+        pthread_mutex_unlock(&piecelock);
+        int ret = fclose(fp);
+        assert(ret==0);
+        // This fails if another job has just finished the file and
+        // removed the saved pieces, including our temporary file.
+        rename(tmp, fn);
+    }
+
+    void LoadPieces(int file, std::vector<OutputPiece>& pieces, int qremove) {
+        // Add the pieces saved by all jobs of this parameter file,
+        // or remove the saved pieces
+        char prefix[1200], fn[2300];
+        ManifestName(file, ".pieces.", prefix);
+        const char *base = prefix+strlen(manifest_dir)+1;
+        DIR *dir = opendir(manifest_dir);
+        assert(dir!=NULL);
+        struct dirent *ent;
+        while ((ent=readdir(dir))!=NULL) {
+            if (strncmp(ent->d_name, base, strlen(base))!=0) continue;
+            sprintf(fn, "%s/%s", manifest_dir, ent->d_name);
+            if (qremove) { unlink(fn); continue; }
+            FILE *fp = fopen(fn, "r");
+            if (fp==NULL) continue;     // Another job has finished the file
+            unsigned long long fp_fingerprint;
+            OutputPiece piece;
+            if (fscanf(fp, "# %llx %*[^\n]", &fp_fingerprint)==1 && fp_fingerprint==fingerprint)
+                while (fscanf(fp, "%lld %lld %llx", &piece.offset, &piece.nbytes, &piece.hash)==3)
+                    pieces.push_back(piece);
+            fclose(fp);
+        }
+        closedir(dir);
+    }
+
+    void FinishFile(int file, off_t size) {
+        // Mark the file complete if all of it has been written.
+        // Other jobs may have written parts of it, so if we haven't written
+        // it all, we save our pieces and look for theirs.
+        // Called with the lock held, once the file is closed.
+        std::vector<OutputPiece> pieces(files[file].pieces);
+        if (!SortPieces(pieces, size)) {
+            SavePieces(file);
+            pieces.clear();
+            LoadPieces(file, pieces, 0);
+            if (!SortPieces(pieces, size)) return;
+        }
+        char fn[1200], tmp[1250], name[1080];
+        FileName(file, name);
+        const char *base = strrchr(name,'/');
+        base = base!=NULL ? base+1 : name;
+        unsigned long long digest = PiecesDigest(pieces);
+        // First the list of pieces, then the marker
+        ManifestName(file, ".xxh", fn);
+        sprintf(tmp, "%s.tmp.%d.%d", fn, zlo, zhi);
+        FILE *fp = fopen(tmp, "w");
+        assert(fp!=NULL);
+        fprintf(fp, "# %s %lld %016llx\n", base, (long long)size, digest);
+        for (size_t j=0;j<pieces.size();j++)
+            fprintf(fp, "%lld %lld %016llx\n", pieces[j].offset, pieces[j].nbytes, pieces[j].hash);
+        int ok = fclose(fp)==0 && rename(tmp, fn)==0;
+        assert(ok);
+        ManifestName(file, ".done", fn);
+        sprintf(tmp, "%s.tmp.%d.%d", fn, zlo, zhi);
+        fp = fopen(tmp, "w");
+        assert(fp!=NULL);
+        fprintf(fp, "%d %lld %016llx %s\n", file, (long long)size, digest, base);
+        ok = fclose(fp)==0 && rename(tmp, fn)==0;
+        assert(ok);
+        LoadPieces(file, pieces, 1);
+        files[file].pieces.clear();
+    }
+
+    virtual void WriteJobData(WriteJob &job, int fd) {
+        // Write the plane into its place in each column.  Called without the lock.
+        if (planebytes==0) {
+            WritePiece(job.file, fd, job.buffer, job.nbytes, job.offset, job.hash[0]);
+            for (int k=0;k<2;k++) if (job.spill[k].nbytes>0)
+                WritePiece(job.spill[k].file, job.spill[k].fd, job.buffer+job.spill[k].start,
+                    job.spill[k].nbytes, job.spill[k].offset);
+            return;
+        }
+        int first = FirstPlane(job.file);
+        int nplanes = FirstPlane(job.file+1)-first;
+        char *src = job.buffer;
+        for (int c=0;c<ncolumn;c++) {
+            WritePiece(job.file, fd, src, colbytes[c], ColumnStart(nplanes,c)+(off_t)(job.z-first)*colbytes[c], job.hash[c]);
+            src += colbytes[c];
+        }
+    }
+
+private:
+    static void *WriterMain(void *arg) {
+        ParticleWriter &pw = *(ParticleWriter *)arg;
+        pthread_mutex_lock(&pw.lock);
+        while (1) {
+            while (pw.njob==0 && !pw.stopping) pthread_cond_wait(&pw.cond,&pw.lock);
+            if (pw.njob==0) break;    // Stopping, and nothing left to do
+            WriteJob job = pw.jobs[pw.head];
+            pw.head = (pw.head+1)%pw.nbuffer; pw.njob--;
+            pw.nbusy++;
+            int fd = pw.files[job.file].fd;
+            for (int k=0;k<2;k++) if (job.spill[k].nbytes>0) job.spill[k].fd = pw.files[job.spill[k].file].fd;
+            pthread_mutex_unlock(&pw.lock);
+
+            pw.WriteJobData(job, fd);
+
+            // A compressed frame overwrote the start of the buffer; clear it,
+            // so that struct padding is still written as zeros
+            if (pw.compressing) memset(job.buffer, 0, job.nbytes);
+            pthread_mutex_lock(&pw.lock);
+            pw.pool[pw.nfree++] = job.buffer;
+            pthread_cond_broadcast(&pw.cond);
+            int file[3], nf = pw.Neighbours(job.z, file);
+            for (int j=0;j<nf;j++)
+                if (--pw.files[file[j]].planes_remaining==0) pw.CloseFile(file[j]);
+            pw.nbusy--;     // Only now, so that Flush() waits for any sorting
+            pthread_cond_broadcast(&pw.cond);
+        }
+        pthread_mutex_unlock(&pw.lock);
+        return NULL;
+    }
+};
+
+template <class T>
+class BinaryParticleWriter: public ParticleWriter {
+public:
+    BinaryParticleWriter(Parameters& _param):
+        ParticleWriter(_param, sizeof(T)*_param.ppd*_param.ppd, sizeof(T)*_param.ppd*_param.ppd) {
+        cellsort = param.qcellsort;
+        // Sorted by cell, the runs of a plane are scattered over the file,
+        // so it is hashed once complete rather than piece by piece
+        if (cellsort) shareable = qhashplanes = 0;
+        ChunkFiles();
+        Start();
+    }
+
+    size_t ConvertPlane(int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
+    BlockArray& array, char *buffer, PlaneStats& stats) {
+        double pos[4], vel[3];
+        T *out = (T *) buffer;
+        // Sorting by cell, we go through the plane a cell at a time, so
+        // that each cell's part of it is one run of the buffer
+        int n = cellsort ? param.cpd : 1;
+        for (int cy=0;cy<n;cy++)
+        for (int cx=0;cx<n;cx++)
+        for (int y=cellsort?FirstRow(cy):0;y<(cellsort?FirstRow(cy+1):array.ppd);y++)
+        for (int x=cellsort?FirstRow(cx):0;x<(cellsort?FirstRow(cx+1):array.ppd);x++) {
+            LoadParticle(y,x,slab1,slab2,slab3,slab4,array,param,pos,vel);
+            SetParticle(*out++,z,y,x,pos,vel);
+            stats.Accumulate(pos);
+        }
+        return (char *)out-buffer;
+    }
+
+    // Sorted by cell, a file holds the cells in turn, each with its run
+    // of every plane in order.  The cells of the lattice locations are
+    // fixed, so each run goes straight to its place.
+    off_t CellStart(int nplanes, int cy, int cx) {
+        // The offset of a cell, in particles
+        return (off_t)nplanes*(1ll*FirstRow(cy)*param.ppd+1ll*(FirstRow(cy+1)-FirstRow(cy))*FirstRow(cx));
+    }
+
+    void WriteJobData(WriteJob &job, int fd) {
+        if (!cellsort) { ParticleWriter::WriteJobData(job, fd); return; }
+        int first = FirstPlane(job.file);
+        int nplanes = FirstPlane(job.file+1)-first;
+        const T *src = (const T *) job.buffer;
+        for (int cy=0;cy<param.cpd;cy++)
+        for (int cx=0;cx<param.cpd;cx++) {
+            long long run = 1ll*(FirstRow(cy+1)-FirstRow(cy))*(FirstRow(cx+1)-FirstRow(cx));
+            pwrite_all(fd, (const char *)src, sizeof(T)*run,
+                sizeof(T)*(CellStart(nplanes,cy,cx)+(job.z-first)*run));
+            src += run;
+        }
+    }
+
+    void SortFile(int file, int fd, off_t size) {
+        // The particles are in place; list the cells, and hash the file
+        // if we keep a manifest
+        int nplanes = FirstPlane(file+1)-FirstPlane(file);
+        long long *index = new long long[2*param.cpd*param.cpd];
+        for (int cy=0;cy<param.cpd;cy++)
+        for (int cx=0;cx<param.cpd;cx++) {
+            int c = cx+param.cpd*cy;
+            index[2*c] = CellStart(nplanes,cy,cx);
+            index[2*c+1] = 1ll*nplanes*(FirstRow(cy+1)-FirstRow(cy))*(FirstRow(cx+1)-FirstRow(cx));
+        }
+        WriteCellIndex(file, index);
+        delete []index;
+        if (qmanifest) HashFile(file);
+    }
+};
+
+class AsciiParticleWriter: public ParticleWriter {
+    // Writes "x y z pos[0..3] vel[0..2]" per line, with the reals in
+    // fixed point with ZD_AsciiPrecision digits, like "%.6f".  We format
+    // the numbers ourselves, since printf is slow and locale-dependent.
+public:
+    int precision;
+    double scale;       // 10^precision
+    AsciiParticleWriter(Parameters& _param):
+        ParticleWriter(_param, 0, MaxLine(_param)*_param.ppd*_param.ppd) {
+        precision = param.ascii_precision;
+        scale = pow(10.0,precision);
+        Start();
+    }
+    static size_t MaxLine(Parameters& param) {
+        // Three integers, then seven reals of up to 12 digits before the
+        // point, or in exponential notation; see put_fixed()
+        return 3*12+7*(param.ascii_precision+16)+1;
+    }
+
+    inline char *put_uint(char *out, unsigned long long v) {
+        char digits[20];
+        int n = 0;
+        do { digits[n++] = '0'+v%10; v /= 10; } while (v>0);
+        while (n>0) *out++ = digits[--n];
+        return out;
+    }
+
+    inline char *put_fixed(char *out, double v) {
+        // With too many digits for v*scale to be exact within one in the
+        // last digit (2^53 is about 9.007e15), we use printf.  Huge or not
+        // finite values go in exponential notation, so that a blown-up
+        // displacement can't overrun the line.  Either way, it takes at
+        // most precision+15 characters.
+        if (!(fabs(v)<1e12) || fabs(v)*scale>=9e15) {
+            char tmp[32];
+            size_t len = precision+16;  // At most 31
+            int n = snprintf(tmp, len, fabs(v)<1e12 ? "%.*f" : "%.*e", precision, v);
+            if (n<0 || (size_t)n>=len) n = len-1;
+            memcpy(out, tmp, n);
+            return out+n;
+        }
+        if (v<0) { *out++ = '-'; v = -v; }
+        unsigned long long q = llround(v*scale);
+        unsigned long long p10 = llround(scale);
+        out = put_uint(out, q/p10);
+        if (precision>0) {
+            unsigned long long frac = q%p10;
+            *out++ = '.';
+            for (int d=precision-1;d>=0;d--) { out[d] = '0'+frac%10; frac /= 10; }
+            out += precision;
+        }
+        return out;
+    }
+
+    size_t ConvertPlane(int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
+    BlockArray& array, char *buffer, PlaneStats& stats) {
+        double pos[4], vel[3];
+        char *out = buffer;
+        size_t maxline = MaxLine(param);
+        for (int y=0;y<array.ppd;y++)
+        for (int x=0;x<array.ppd;x++) {
+            if (out+maxline>buffer+buffersize) {
+                fprintf(stderr,"Error: the ASCII output of plane %d overflows its buffer.\n",z);
+                exit(1);
+            }
+            LoadParticle(y,x,slab1,slab2,slab3,slab4,array,param,pos,vel);
+            out = put_uint(out,x); *out++ = ' ';
+            out = put_uint(out,y); *out++ = ' ';
+            out = put_uint(out,z);
+            for (int i=0;i<4;i++) { *out++ = ' '; out = put_fixed(out,pos[i]); }
+            for (int i=0;i<3;i++) { *out++ = ' '; out = put_fixed(out,vel[i]); }
+            *out++ = '\n';
+            stats.Accumulate(pos);
+        }
+        return out-buffer;
+    }
+};
+
+class QuantParticleWriter: public ParticleWriter {
+    // Stores the displacements and velocities as 16-bit integers,
+    // scaled by the largest absolute value in the plane.
+    // The rounding error is at most half of the scale.
+public:
+    QuantParticleWriter(Parameters& _param): ParticleWriter(_param, PlaneBytes(_param), PlaneBytes(_param)) {
+        ChunkFiles();
+        Start();
+    }
+    static size_t PlaneBytes(Parameters& param) {
+        return sizeof(RVQuantZelPlaneHeader)+sizeof(RVQuantZelParticle)*param.ppd*param.ppd;
+    }
+
+    inline short quantize(double v, float scale, double &err) {
+        long q = lrint(v/scale);
+        if (q>32767) q = 32767;    // The float scale may round down
+        if (q<-32767) q = -32767;
+        double e = fabs(v-q*(double)scale);
+        if (e>err) err = e;
+        return q;
+    }
+
+    size_t ConvertPlane(int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
+    BlockArray& array, char *buffer, PlaneStats& stats) {
+        double pos[4], vel[3];
+        // First find the range of the plane
+        double maxdispl = 0.0, maxvel = 0.0;
+        for (int y=0;y<array.ppd;y++)
+        for (int x=0;x<array.ppd;x++) {
+            LoadParticle(y,x,slab1,slab2,slab3,slab4,array,param,pos,vel);
+            for (int i=0;i<3;i++) {
+                if (fabs(pos[i])>maxdispl) maxdispl = fabs(pos[i]);
+                if (fabs(vel[i])>maxvel) maxvel = fabs(vel[i]);
+            }
+        }
+        RVQuantZelPlaneHeader *head = (RVQuantZelPlaneHeader *) buffer;
+        head->z = z; head->ppd = array.ppd;
+        head->displscale = maxdispl>0 ? maxdispl/32767.0 : 1.0;
+        head->velscale = maxvel>0 ? maxvel/32767.0 : 1.0;
+
+        RVQuantZelParticle *out = (RVQuantZelParticle *) (head+1);
+        for (int y=0;y<array.ppd;y++)
+        for (int x=0;x<array.ppd;x++) {
+            LoadParticle(y,x,slab1,slab2,slab3,slab4,array,param,pos,vel);
+            // Output in (z,y,x) order, as in the other formats
+            for (int i=0;i<3;i++) {
+                out->displ[i] = quantize(pos[2-i],head->displscale,stats.quant_err[0]);
+                out->vel[i] = quantize(vel[2-i],head->velscale,stats.quant_err[1]);
+            }
+            out++;
+            stats.Accumulate(pos);
+        }
+        return (char *)out-buffer;
+    }
+
+    void Summary() {
+        printf("The maximum quantization errors are %g in displacement and %g in velocity,\n", max_quant_err[0], max_quant_err[1]);
+        printf("or %g and %g of the particle spacing.\n", max_quant_err[0]/param.separation, max_quant_err[1]/param.separation);
+    }
+};
+
+class ColumnParticleWriter: public ParticleWriter {
+    // Writes each plane's part of the six columns.  The lattice location
+    // is implied by the position in the column.
+public:
+    ColumnParticleWriter(Parameters& _param):
+        ParticleWriter(_param, 6*sizeof(float)*_param.ppd*_param.ppd, 6*sizeof(float)*_param.ppd*_param.ppd) {
+        ncolumn = 6;
+        for (int c=0;c<ncolumn;c++) colbytes[c] = sizeof(float)*param.ppd*param.ppd;
+        headerbytes = 4096;
+        ChunkFiles();
+        Start();
+    }
+
+    void WriteFileHeader(int fd, int file, int first, int last) {
+        char header[4096];
+        memset(header,0,4096);
+        RVZelColumnsHeader *head = (RVZelColumnsHeader *) header;
+        strcpy(head->magic,"ZDCOLS1");
+        head->ppd = param.ppd;
+        head->zfirst = first; head->nplanes = last-first;
+        head->ncolumn = ncolumn;
+        WritePiece(file, fd, header, 4096, 0);
+    }
+
+    // Copy one component of the complex plane into a column
+    void deinterleave(Complx *slab, int imag, float *out, int n) {
+        double *in = (double *)slab+imag;
+        #pragma omp simd
+        for (int j=0;j<n;j++) out[j] = in[2*j];
+    }
+
+    size_t ConvertPlane(int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
+    BlockArray& array, char *buffer, PlaneStats& stats) {
+        // See LoadParticle for the packing of the displacements and velocities
+        int n = array.ppd*array.ppd;
+        float *col = (float *) buffer;
+        deinterleave(slab2, 1, col, n);      // displ z
+        deinterleave(slab2, 0, col+n, n);    // displ y
+        deinterleave(slab1, 1, col+2*n, n);  // displ x
+        if (param.qPLT || param.q2LPT) {
+            deinterleave(slab4, 1, col+3*n, n);
+            deinterleave(slab4, 0, col+4*n, n);
+            deinterleave(slab3, 1, col+5*n, n);
+        } else memcpy(col+3*n, col, 3*n*sizeof(float));
+
+        double pos[4], vel[3];
+        for (int y=0;y<array.ppd;y++)
+        for (int x=0;x<array.ppd;x++) {
+            LoadParticle(y,x,slab1,slab2,slab3,slab4,array,param,pos,vel);
+            stats.Accumulate(pos);
+        }
+        return 6*n*sizeof(float);
+    }
+};
+
+ParticleWriter *NewGadgetWriter(Parameters& param, int qhdf5);   // In gadget.cpp
+
+template <class T>
+class BinnedParticleWriter: public ParticleWriter {
+    // Writes each particle to the ic_ file of the slab of its final
+    // (wrapped) z position, rather than that of its lattice plane.
+    // The particles of each plane that leave the slab go at the end of
+    // the buffer, first those for the slab below, then above, and are
+    // appended to those files.  A particle may not move more than one slab.
+public:
+    BinnedParticleWriter(Parameters& _param):
+        ParticleWriter(_param, 0, sizeof(T)*_param.ppd*_param.ppd) {
+        binning = 1;
+        cellsort = param.qcellsort;
+        spillbytes = new size_t[param.ppd][2];
+        cellcount = new long long *[nfile];
+        for (int f=0;f<nfile;f++) cellcount[f] = NULL;
+        Start();
+    }
+    ~BinnedParticleWriter() {
+        Close();    // Before the counts go, as the writers may still be sorting
+        for (int f=0;f<nfile;f++) delete []cellcount[f];
+        delete []cellcount;
+    }
+
+    // Sorting by cell, we count the particles of each cell of a file as
+    // they are written.  Once the file is complete, we read it back in
+    // pieces of a plane, and write each cell's particles of the piece
+    // straight to their place in a new file, which replaces it.
+    long long **cellcount;  // For each open file, its particles per cell
+
+    int CellOf(const T &p) {
+        // The cell of the particle's final position
+        return FinalSlab(p.k, p.displ[2])+param.cpd*FinalSlab(p.j, p.displ[1]);
+    }
+    void CountCells(int file, const char *src, size_t nbytes) {
+        // Called without the lock, so other writers may count into file too
+        const T *p = (const T *) src;
+        for (size_t j=0;j<nbytes/sizeof(T);j++)
+            __sync_fetch_and_add(&cellcount[file][CellOf(p[j])], 1ll);
+    }
+    void WriteJobData(WriteJob &job, int fd) {
+        ParticleWriter::WriteJobData(job, fd);
+        if (!cellsort) return;
+        CountCells(job.file, job.buffer, job.nbytes);
+        for (int k=0;k<2;k++) if (job.spill[k].nbytes>0)
+            CountCells(job.spill[k].file, job.buffer+job.spill[k].start, job.spill[k].nbytes);
+    }
+    void OpenFile(int file, int first, int last) {
+        ParticleWriter::OpenFile(file, first, last);
+        if (!cellsort) return;
+        int ncell = param.cpd*param.cpd;
+        cellcount[file] = new long long[ncell];
+        for (int c=0;c<ncell;c++) cellcount[file][c] = 0;
+    }
+    void CloseFile(int file) {
+        ParticleWriter::CloseFile(file);
+        delete []cellcount[file];
+        cellcount[file] = NULL;
+    }
+
+    double SortMemory() {
+        // The piece read back, its sorted copy and cells, and the counts,
+        // offsets and index of the cells
+        if (!cellsort) return 0.0;
+        return (2.0+(double)sizeof(int)/sizeof(T))*buffersize+5.0*sizeof(long long)*param.cpd*param.cpd;
+    }
+
+    void SortFile(int file, int fd, off_t size) {
+        int ncell = param.cpd*param.cpd;
+        long long *index = new long long[2*ncell], *next = new long long[ncell];
+        long long n = size/sizeof(T), start = 0;
+        for (int c=0;c<ncell;c++) {
+            index[2*c] = next[c] = start;
+            start += index[2*c+1] = cellcount[file][c];
+        }
+        if (start!=n) {
+            fprintf(stderr,"Error: file %d holds %lld particles, not the %lld counted.\n",file,n,start);
+            exit(1);
+        }
+        char fn[1080], tmp[1100];
+        FileName(file, fn);
+        sprintf(tmp, "%s.sorting", fn);
+        int out = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if (out<0) {
+            fprintf(stderr,"Error: could not open %s: %s\n",tmp,strerror(errno));
+            exit(1);
+        }
+        fallocate(out, 0, 0, size);
+        long long chunk = buffersize/sizeof(T);
+        T *in = new T[chunk], *sorted = new T[chunk];
+        int *cell = new int[chunk];
+        long long *end = new long long[ncell];
+        for (long long done=0;done<n;done+=chunk) {
+            long long m = n-done<chunk ? n-done : chunk;
+            for (size_t got=0;got<m*sizeof(T);) {
+                ssize_t ret = pread(fd, (char *)in+got, m*sizeof(T)-got, done*sizeof(T)+got);
+                if (ret<=0 && errno!=EINTR) {
+                    fprintf(stderr,"Error: reading back file %d to sort it failed: %s\n",file,strerror(errno));
+                    exit(1);
+                }
+                if (ret>0) got += ret;
+            }
+            // A counting sort of the piece, then each cell's run goes
+            // after those of the pieces before
+            for (int c=0;c<ncell;c++) end[c] = 0;
+            for (long long j=0;j<m;j++) end[cell[j] = CellOf(in[j])]++;
+            for (long long c=0,start=0;c<ncell;c++) { start += end[c]; end[c] = start; }
+            for (long long j=m-1;j>=0;j--) sorted[--end[cell[j]]] = in[j];
+            for (int c=0;c<ncell;c++) {
+                long long run = (c<ncell-1 ? end[c+1] : m)-end[c];
+                if (run==0) continue;
+                pwrite_all(out, (const char *)(sorted+end[c]), sizeof(T)*run, sizeof(T)*next[c]);
+                next[c] += run;
+            }
+        }
+        int ok = close(out)==0 && rename(tmp, fn)==0;
+        assert(ok);
+        WriteCellIndex(file, index);
+        delete []in; delete []sorted; delete []cell;
+        delete []end; delete []index; delete []next;
+        // What we hashed as we appended is no longer the file
+        pthread_mutex_lock(&piecelock);
+        files[file].pieces.clear();
+        pthread_mutex_unlock(&piecelock);
+        if (qmanifest) HashFile(file);
+    }
+
+    int Destination(int z, double dz) {
+        // Return 0 if a particle of plane z, displaced by dz, stays in
+        // the slab, 1 if it moves to the slab below, 2 if above, and -1
+        // if it moves further.
+        int slab = FinalSlab(z, dz), s = FileOf(z);
+        if (slab==s) return 0;
+        if (slab==(s+param.cpd-1)%param.cpd) return 1;
+        if (slab==(s+1)%param.cpd) return 2;
+        return -1;
+    }
+
+    size_t ConvertPlane(int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
+    BlockArray& array, char *buffer, PlaneStats& stats) {
+        double pos[4], vel[3];
+        int count[3] = {0,0,0};
+        // First count the particles for each file
+        for (int y=0;y<array.ppd;y++)
+        for (int x=0;x<array.ppd;x++) {
+            LoadParticle(y,x,slab1,slab2,slab3,slab4,array,param,pos,vel);
+            int d = Destination(z,pos[2]);
+            if (d<0) {
+                fprintf(stderr,"Error: the particle at (z,y,x) = (%d,%d,%d) moves %g in z, more than a slab.\n"
+                    "ZD_qfinalslab needs a smaller CPD.\n", z, y, x, pos[2]);
+                exit(1);
+            }
+            count[d]++;
+        }
+        T *out[3];
+        out[0] = (T *) buffer; out[1] = out[0]+count[0]; out[2] = out[1]+count[1];
+        for (int y=0;y<array.ppd;y++)
+        for (int x=0;x<array.ppd;x++) {
+            LoadParticle(y,x,slab1,slab2,slab3,slab4,array,param,pos,vel);
+            SetParticle(*out[Destination(z,pos[2])]++,z,y,x,pos,vel);
+            stats.Accumulate(pos);
+        }
+        spillbytes[z][0] = sizeof(T)*count[1];
+        spillbytes[z][1] = sizeof(T)*count[2];
+        return sizeof(T)*array.ppd*array.ppd;
+    }
+};
+
+ParticleWriter *NewParticleWriter(Parameters& param) {
+    // Resolve the output format once
+    if (param.qfinalslab && !param.qascii) {
+        if (strcmp(param.ICFormat, "RVdoubleZel") == 0)
+            return new BinnedParticleWriter<RVdoubleZelParticle>(param);
+        if (strcmp(param.ICFormat, "RVZel") == 0)
+            return new BinnedParticleWriter<RVZelParticle>(param);
+        if (strcmp(param.ICFormat, "Zeldovich") == 0)
+            return new BinnedParticleWriter<ZelParticle>(param);
+    }
+    if (param.qfinalslab) {
+        fprintf(stderr, "Error: ZD_qfinalslab needs the RVdoubleZel, RVZel or Zeldovich ICFormat. Aborting.\n");
+        exit(1);
+    }
+    if (param.qascii) return new AsciiParticleWriter(param);
+    if (strcmp(param.ICFormat, "RVdoubleZel") == 0)
+        return new BinaryParticleWriter<RVdoubleZelParticle>(param);
+    if (strcmp(param.ICFormat, "RVZel") == 0)
+        return new BinaryParticleWriter<RVZelParticle>(param);
+    if (strcmp(param.ICFormat, "RVZelColumns") == 0)
+        return new ColumnParticleWriter(param);
+    if (strcmp(param.ICFormat, "RVQuantZel") == 0)
+        return new QuantParticleWriter(param);
+    if (strcmp(param.ICFormat, "Gadget") == 0)
+        return NewGadgetWriter(param, 0);
+    if (strcmp(param.ICFormat, "HDF5") == 0)
+        return NewGadgetWriter(param, 1);
+    if (strcmp(param.ICFormat, "Zeldovich") == 0)
+        return new BinaryParticleWriter<ZelParticle>(param);
+    fprintf(stderr, "Error: unknown ICFormat \"%s\". Aborting.\n", param.ICFormat);
+    exit(1);
+}
+
+void PairedDirectory(Parameters& param, char *paired) {
+    // Make the subdirectory paired of the output directory, for the
+    // paired realization, and put its name in paired
+    if (snprintf(paired, sizeof(param.output_dir), "%s/paired", param.output_dir)>=(int)sizeof(param.output_dir)) {
+        fprintf(stderr,"Error: the paired output directory name is too long.\n");
+        exit(1);
+    }
+    if (mkdir(paired, 0755)!=0 && errno!=EEXIST) {
+        fprintf(stderr,"Error: could not make %s: %s\n",paired,strerror(errno));
+        exit(1);
+    }
+}
+
+ParticleWriter *NewPairedWriter(Parameters& param) {
+    // The writer of the paired realization.  A writer takes its directory
+    // from the parameters when it is made, so we point them there meanwhile.
+    char dir[sizeof(param.output_dir)], paired[sizeof(param.output_dir)];
+    PairedDirectory(param, paired);
+    strcpy(dir, param.output_dir);
+    strcpy(param.output_dir, paired);
+    ParticleWriter *pair = NewParticleWriter(param);
+    strcpy(param.output_dir, dir);
+    return pair;
+}
+
+void ResetPairedWriter(ParticleWriter *pair, Parameters& param) {
+    // Point the writer of the paired realization at that of the next
+    // realization of a batch
+    char paired[sizeof(param.output_dir)];
+    PairedDirectory(param, paired);
+    pair->Reset(paired);
+}
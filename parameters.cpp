@@ -17,17 +17,27 @@ public:
     double nyquist;    // PI/separation
     double k_cutoff; // the wavenumber above which to not input any power, expressed such that k_max = k_nyquist/k_cutoff.  2 = half nyquist, etc.
     int qdensity;    // If non-zero, output the density
+    int qdisplacement;    // If non-zero, output the displacement grids
     int qascii;        // If non-zero, output in ASCII
+    int ascii_precision;    // Digits after the decimal point in the ASCII output
     int qnoheader;    // If non-zero, don't attach a header
     int qvelocity;    // If non-zero, include the velocities in the binary output
     int qoneslab;    // If >=0, only output this z slab.
+    int qfinalslab;    // If non-zero, write each particle to the file of the slab of its final position
+    int qcellsort;    // If non-zero, group the particles of each file by cell, with an index of the cells
     int seed;    // Random number seed
+    int file_seed;    // The seed given in the parameter file, if a batch changes it
+    int qfixed;    // If non-zero, give every mode the rms amplitude, with a random phase
+    int qpaired;    // If non-zero, also output the partner realization, with every mode negated
     double Pk_norm;    // The scale to normalize P(k) at, in simulation units!
     double Pk_sigma;    // The normalization at that scale, at the initial redshift!
     double Pk_smooth;    // The scale to smooth P(k) at, in simulation units!
     char Pk_filename[200];   // The file name for the P(k) input
     char output_dir[1024];   // The file name for the Output
     char density_filename[200];   // The file name for a density file output
+    int cic_grid;    // If non-zero, the size of the grid for the CIC density of the displaced particles
+    char cic_filename[200];   // The file name for the CIC density
+    char swap_dirs[4096];   // Colon-separated list of directories for the swap
     double z_initial;
     HeaderStream * inputstream; // Header stream from which the parameters were read. After instantiation, points to end of header so binary data could potentially be read
 
@@ -35,6 +45,7 @@ public:
     int one_mode[3]; // Contains one k-vector to select
     
     int qPLT; // If non-zero, use the Particle Linear Theory modes read from a file
+    int q2LPT; // If non-zero, add the second-order (2LPT) displacements, computed in Fourier space
     char PLT_filename[1024]; // file containing PLT eigenmodes
     int qPLTrescale; // If non-zero, rescale the initial amplitudes to match continuum linear theory at PLT_target_z
     double PLT_target_z; // The target redshift for the PLT rescaling
@@ -42,6 +53,17 @@ public:
     char ICFormat[1024]; // Abacus's expected input format (i.e. our output format)
     
     int ramdisk; // If -DDIRECTIO, need to know if we're on a ramdisk
+    int qfloatswap; // If non-zero, store the swap space in single precision
+    int qcheckpoint; // If non-zero, keep a progress journal and resume from it
+    int io_threads; // Number of threads reading swap blocks concurrently
+    int num_writers; // Number of background threads writing the ic_ files
+    int write_buffers; // Number of plane buffers queued for the writers
+    int qmanifest; // If non-zero, mark each complete output file, with its size and checksum
+    long long int particles_per_file; // Particles per output file, or 0 for one per slab
+    long long int file_bytes; // Target bytes per output file, or 0 for one per slab
+    int compress_level; // If non-zero, the zstd level to compress the output files with
+    double Omega_M; // Gadget/HDF5 output: for the velocities and particle mass
+    double hubble; // Gadget/HDF5 output: h, recorded in the file headers
     
 
     int setup();
@@ -58,25 +80,46 @@ public:
         boxsize = 0;    // Illegal
         Pk_scale = 1;    // Legal default
         qdensity = 0;    // Legal default
+        qdisplacement = 0;    // Legal default
         qascii = 0;    // Legal default
+        ascii_precision = 6;    // Legal default
         qvelocity = 0;    // Legal default
         qnoheader = 0;    // Legal default
         qoneslab = -1;    // Legal default
+        qfinalslab = 0;    // Legal default
+        qcellsort = 0;    // Legal default
         Pk_norm = 0;    // Legal default: Don't renormalize the power spectrum
         Pk_sigma = 0;    // Legal default, but you probably don't want this!
         Pk_smooth = 0;    // Legal default
         seed = 0;    // Legal default
+        qfixed = 0;    // Legal default
+        qpaired = 0;    // Legal default
         strcpy(Pk_filename,"");   // Illegal
         strcpy(density_filename,"output.density");  // Legal default
+        cic_grid = 0;    // Legal default
+        strcpy(cic_filename,"output.cic");  // Legal default
+        strcpy(swap_dirs,"");  // Legal default: swap in output_dir
         qonemode = 0; // Legal default
         memset(one_mode, 0, 3*sizeof(int)); // Legal default
         qPLT = 0; // Legal default
+        q2LPT = 0; // Legal default
         strcpy(PLT_filename,""); // Legal default
         qPLTrescale = 0; // Legal default
         PLT_target_z = 0.; // Legal default, probably don't want!
         k_cutoff = 1.; // Legal default (corresponds to k_nyquist)
         strcpy(ICFormat,""); // Illegal default
         ramdisk = 0;  // Legal default for most cases
+        qfloatswap = 0; // Legal default
+        qcheckpoint = 0; // Legal default
+        io_threads = 0; // Legal default: one per swap directory
+        num_writers = 2; // Legal default
+        write_buffers = 0; // Legal default: two per thread
+        qmanifest = 0; // Legal default
+        particles_per_file = 0; // Legal default
+        file_bytes = 0; // Legal default
+        compress_level = 0; // Legal default
+        Omega_M = 1.0; // Legal default: EdS
+        hubble = 1.0; // Legal default
         
         // Read the paramater file values
         register_vars();
@@ -96,9 +139,16 @@ public:
         T = gsl_rng_mt19937; //The mersene twister
         int block = ppd/numblock;
         rng = new gsl_rng *[block];
-        for (int i = 0; i < block; i++){
-            rng[i] = gsl_rng_alloc (T);
-            //seed the rng. a seed of zero uses the current time
+        for (int i = 0; i < block; i++) rng[i] = gsl_rng_alloc (T);
+        file_seed = seed;
+        seed_rng(seed);
+    }
+
+    void seed_rng(int _seed) {
+        // (Re)seed the RNGs, for a new realization.
+        // A seed of zero uses the current time.
+        seed = _seed;
+        for (int i = 0; i < ppd/numblock; i++){
             if(seed == 0) gsl_rng_set(rng[i],time(0)+i);
             else gsl_rng_set(rng[i],seed+i);
         }
@@ -114,26 +164,48 @@ public:
         installscalar("ZD_NumBlock",numblock,MUST_DEFINE);
         installscalar("CPD",cpd,MUST_DEFINE);
         installscalar("ZD_qdensity",qdensity,DONT_CARE);
+        installscalar("ZD_qdisplacement",qdisplacement,DONT_CARE);
         installscalar("ZD_qnoheader",qnoheader,DONT_CARE);
+        installscalar("ZD_qascii",qascii,DONT_CARE);
+        installscalar("ZD_AsciiPrecision",ascii_precision,DONT_CARE);
         installscalar("ZD_qvelocity",qvelocity,DONT_CARE);
         installscalar("ZD_qoneslab",qoneslab,DONT_CARE);
+        installscalar("ZD_qfinalslab",qfinalslab,DONT_CARE);
+        installscalar("ZD_qcellsort",qcellsort,DONT_CARE);
         installscalar("ZD_Seed",seed,MUST_DEFINE);
+        installscalar("ZD_qfixed",qfixed,DONT_CARE);
+        installscalar("ZD_qpaired",qpaired,DONT_CARE);
         installscalar("ZD_Pk_norm",Pk_norm,MUST_DEFINE);
         installscalar("ZD_Pk_sigma",Pk_sigma,MUST_DEFINE);
         installscalar("ZD_Pk_smooth",Pk_smooth,MUST_DEFINE);
         installscalar("ZD_Pk_filename",Pk_filename,MUST_DEFINE);
         installscalar("InitialConditionsDirectory",output_dir,MUST_DEFINE);
+        installscalar("ZD_SwapDirectories",swap_dirs,DONT_CARE);
         installscalar("ZD_density_filename",density_filename,DONT_CARE);
+        installscalar("ZD_CICGrid",cic_grid,DONT_CARE);
+        installscalar("ZD_CIC_filename",cic_filename,DONT_CARE);
         installscalar("InitialRedshift",z_initial,MUST_DEFINE);
         installscalar("ZD_qonemode",qonemode,DONT_CARE);
         installvector("ZD_one_mode",one_mode,3,1,DONT_CARE);
         installscalar("ZD_qPLT",qPLT,DONT_CARE);
+        installscalar("ZD_q2LPT",q2LPT,DONT_CARE);
         installscalar("ZD_PLT_filename",PLT_filename,DONT_CARE);
         installscalar("ZD_qPLT_rescale",qPLTrescale,DONT_CARE);
         installscalar("ZD_PLT_target_z",PLT_target_z,DONT_CARE);
         installscalar("ZD_k_cutoff",k_cutoff,DONT_CARE);
         installscalar("ICFormat",ICFormat,MUST_DEFINE);
         installscalar("RamDisk",ramdisk,DONT_CARE);
+        installscalar("ZD_qfloatswap",qfloatswap,DONT_CARE);
+        installscalar("ZD_qcheckpoint",qcheckpoint,DONT_CARE);
+        installscalar("ZD_IOThreads",io_threads,DONT_CARE);
+        installscalar("ZD_NumWriters",num_writers,DONT_CARE);
+        installscalar("ZD_WriteBuffers",write_buffers,DONT_CARE);
+        installscalar("ZD_qmanifest",qmanifest,DONT_CARE);
+        installscalar("ZD_ParticlesPerFile",particles_per_file,DONT_CARE);
+        installscalar("ZD_FileBytes",file_bytes,DONT_CARE);
+        installscalar("ZD_Compress",compress_level,DONT_CARE);
+        installscalar("ZD_Omega_M",Omega_M,DONT_CARE);
+        installscalar("ZD_HubbleParam",hubble,DONT_CARE);
     }
 
 
@@ -169,6 +241,7 @@ int Parameters::setup() {
     assert(! (strlen(Pk_filename)==0) );
     if(qPLT) assert(! (strlen(PLT_filename)==0) );
     assert(k_cutoff >= 1);
+    assert(ascii_precision>=0 && ascii_precision<=15);
     
     // If using PLT, you probably want an output format with velocities
     if(qPLT)
@@ -195,6 +268,7 @@ void Parameters::print(FILE *fp) {
     tm * now = localtime(& t);
     
     WriteHStream(fp, *inputstream);
+    if (seed!=file_seed) fprintf(fp,"#batch realization with ZD_Seed = %d\n", seed);
     fprintf(fp,"#modified by ");
     fprintf(fp,VERSION);
     fprintf(fp," TIME:  ");
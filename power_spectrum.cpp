@@ -118,9 +118,12 @@ public:
     double one_rand(int i) {
         return gsl_rng_uniform(rng[i]);
     }
-    Complx cgauss(double wavenumber, int rng) {
+    Complx cgauss(double wavenumber, int rng, int qfixed) {
         // Return a gaussian complex deviate scaled to the sqrt of the power
         // Box-Muller, adapted from Numerical Recipes
+        // With qfixed, keep the phase but fix the modulus to the sqrt of
+        // the power, using the same random numbers, so that a fixed
+        // realization has the phases of the Gaussian one with the same seed.
         double Pk = this->power(wavenumber);
         double phase1, phase2, r2;
         // printf("P(%f) = %g\n",wavenumber,Pk);
@@ -129,9 +132,91 @@ public:
             phase2 = one_rand(rng)*2.0-1.0;
             r2 = phase1*phase1+phase2*phase2;
         } while (!(r2<1.0&&r2>0.0));
+        if (qfixed) {
+            r2 = sqrt(Pk/r2);
+            return Complx(phase1*r2,phase2*r2);
+        }
         r2 = sqrt(-Pk*log(r2)/r2);   // Drop the factor of 2, so these Gaussians
         // have variance of 1/2.
         // printf("cgauss: %f %f\n", phase1*r2, phase2*r2);
         return Complx(phase1*r2,phase2*r2);
     }
 };
+
+class PkHistogram {
+    // The power of the generated modes, binned in shells of |k| one
+    // fundamental wide, with the input power of the same modes alongside.
+    // Each mode of the half-space that we generate is counted once, which
+    // covers every independent mode of the box.  The Z pass fills one
+    // histogram per plane, and they are combined in a fixed order, so that
+    // the totals don't depend on the number of threads.
+public:
+    int nbin;
+    double *ksum, *measured, *input;    // Sums over the modes of each bin
+    long long *count;
+
+    PkHistogram() { nbin = 0; ksum = measured = input = NULL; count = NULL; }
+    ~PkHistogram() { delete []ksum; delete []measured; delete []input; delete []count; }
+    void Init(int ppd) {
+        // Enough bins for the corners of the cube
+        nbin = (int)(sqrt(3.0)*ppd/2)+2;
+        ksum = new double[nbin]; measured = new double[nbin]; input = new double[nbin];
+        count = new long long[nbin];
+        Clear();
+    }
+    void Clear() {
+        for (int b=0;b<nbin;b++) { ksum[b] = measured[b] = input[b] = 0.0; count[b] = 0; }
+    }
+    inline void Add(int kx, int ky, int kz, double wavenumber, Complx D, double power) {
+        int b = (int)(sqrt((double)(kx*kx+ky*ky+kz*kz))+0.5);
+        ksum[b] += wavenumber;
+        measured[b] += norm(D);
+        input[b] += power;
+        count[b]++;
+    }
+    void AddTo(PkHistogram& total) {
+        for (int b=0;b<nbin;b++) {
+            total.ksum[b] += ksum[b]; total.measured[b] += measured[b];
+            total.input[b] += input[b]; total.count[b] += count[b];
+        }
+    }
+    // For the checkpoint
+    void Write(FILE *fp) {
+        fwrite(ksum,sizeof(double),nbin,fp); fwrite(measured,sizeof(double),nbin,fp);
+        fwrite(input,sizeof(double),nbin,fp); fwrite(count,sizeof(long long),nbin,fp);
+    }
+    int Read(FILE *fp) {
+        return fread(ksum,sizeof(double),nbin,fp)==(size_t)nbin
+            && fread(measured,sizeof(double),nbin,fp)==(size_t)nbin
+            && fread(input,sizeof(double),nbin,fp)==(size_t)nbin
+            && fread(count,sizeof(long long),nbin,fp)==(size_t)nbin;
+    }
+
+    void Report(Parameters& param) {
+        // Write the measured and input P(k), in the units of the input
+        // file, to zeldovich.pk, and compare their totals.  The wavenumbers
+        // were multiplied by ZD_Pk_scale when the file was loaded, so we
+        // undo that; the power is as the file gives it (times any
+        // normalization), once we undo the division by the box volume.
+        char fn[1100];
+        sprintf(fn,"%s/zeldovich.pk",param.output_dir);
+        FILE *fp = fopen(fn,"w");
+        assert(fp!=NULL);
+        double volume = param.boxsize*param.boxsize*param.boxsize;
+        double totmeasured = 0.0, totinput = 0.0;
+        long long nmode = 0;
+        fprintf(fp,"# k P_measured P_input nmodes\n");
+        for (int b=0;b<nbin;b++) {
+            if (count[b]==0) continue;
+            fprintf(fp,"%.8e %.8e %.8e %lld\n", ksum[b]/count[b]/param.Pk_scale,
+                measured[b]/count[b]*volume, input[b]/count[b]*volume, count[b]);
+            totmeasured += measured[b]; totinput += input[b]; nmode += count[b];
+        }
+        fclose(fp);
+        if (nmode>0)
+            printf("The %lld generated modes have %f of the input power; the measured P(k) is in %s\n",
+                nmode, totmeasured/totinput, fn);
+    }
+};
+
+PkHistogram measured_pk;    // Of the whole Z pass
@@ -0,0 +1,66 @@
+/* Reference decoder for the RVQuantZel output format.
+ * Each z plane of an ic_ file is a header followed by PPD^2 particles
+ * in (y,x) order.  The displacements and velocities are 16-bit integers,
+ * to be multiplied by the scales in the plane header.
+ * This prints one particle per line in the ASCII order of the RVZel
+ * format: i j k displ[3] vel[3], with (i,j,k) = (z,y,x).
+ * Usage: quant_decode ic_file [ic_file ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+    int z, ppd;
+    float displscale, velscale;
+} RVQuantZelPlaneHeader;
+
+typedef struct {
+    short displ[3];
+    short vel[3];
+} RVQuantZelParticle;
+
+int decode(const char *fn) {
+    FILE *fp = fopen(fn, "rb");
+    RVQuantZelPlaneHeader head;
+    RVQuantZelParticle *plane = NULL;
+    int nalloc = 0;
+    if (fp == NULL) {
+        fprintf(stderr, "Error: could not open %s\n", fn);
+        return 1;
+    }
+    while (fread(&head, sizeof(head), 1, fp) == 1) {
+        int n = head.ppd*head.ppd, y, x, i;
+        if (n > nalloc) {
+            free(plane);
+            plane = (RVQuantZelParticle *) malloc(sizeof(RVQuantZelParticle)*n);
+            nalloc = n;
+        }
+        if (fread(plane, sizeof(RVQuantZelParticle), n, fp) != (size_t) n) {
+            fprintf(stderr, "Error: %s is truncated in plane %d\n", fn, head.z);
+            fclose(fp); free(plane);
+            return 1;
+        }
+        for (y = 0; y < head.ppd; y++)
+            for (x = 0; x < head.ppd; x++) {
+                RVQuantZelParticle *p = plane + x + head.ppd*y;
+                printf("%d %d %d", head.z, y, x);
+                for (i = 0; i < 3; i++) printf(" %.9g", p->displ[i]*(double)head.displscale);
+                for (i = 0; i < 3; i++) printf(" %.9g", p->vel[i]*(double)head.velscale);
+                printf("\n");
+            }
+    }
+    fclose(fp);
+    free(plane);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int j, ret = 0;
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s ic_file [ic_file ...]\n", argv[0]);
+        return 1;
+    }
+    for (j = 1; j < argc; j++) ret |= decode(argv[j]);
+    return ret;
+}
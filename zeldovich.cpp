@@ -26,17 +26,26 @@ v1.7-- Support for PLT eigenmodes and rescaling
 #include <cstdlib>
 #include <ctime>
 #include <cctype>
+#include <climits>
 #include <cstring>
 #include <complex>
+#include <vector>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <fstream>
 #include <gsl/gsl_rng.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "spline_function.h"
 #include "header.h"
 #include "ParseHeader.hh"
 #include <omp.h>
+#include <pthread.h>
 
 #ifdef DIRECTIO
 // DIO libraries
@@ -49,7 +58,16 @@ v1.7-- Support for PLT eigenmodes and rescaling
 #include "iolib.cpp"
 #endif
 
+#ifdef HDF5
+#include <hdf5.h>
+#endif
+
+#ifdef ZSTD
+#include <zstd.h>
+#endif
+
 #define Complx std::complex<double>
+#define ComplxFloat std::complex<float>
 
 static double __dcube;
 #define CUBE(a) ((__dcube=(a))==0.0?0.0:__dcube*__dcube*__dcube)
@@ -62,18 +80,27 @@ double max_disp[3];
 #include "parameters.cpp"
 #include "power_spectrum.cpp"
 #include "block_array.cpp"
+#include "checksum.cpp"
 #include "output.cpp"
+#include "grid.cpp"
+#include "gadget.cpp"
+#include "checkpoint.cpp"
 
 // ===============================================================
 
 // TODO: Replace with our own FFT
 #include "fftw3.h"
 fftw_plan plan1d, plan2d;
-void Setup_FFTW(int n) {
+fftw_plan plan1d_forward, plan2d_forward;   // Only for 2LPT
+void Setup_FFTW(int n, int qforward) {
     fftw_complex *p;
     p = new fftw_complex[n*n];
     plan1d = fftw_plan_dft_1d(n, p, p, +1, FFTW_PATIENT);
     plan2d = fftw_plan_dft_2d(n, n, p, p, +1, FFTW_PATIENT);
+    if (qforward) {
+        plan1d_forward = fftw_plan_dft_1d(n, p, p, -1, FFTW_PATIENT);
+        plan2d_forward = fftw_plan_dft_2d(n, n, p, p, -1, FFTW_PATIENT);
+    }
     delete []p;
     return;
 }
@@ -88,9 +115,13 @@ void Inverse2dFFT(Complx *p, int n) {
     // Do the 2d inverse FFT in place
     fftw_execute_dft(plan2d, (fftw_complex *)p, (fftw_complex *)p);
 }
-void InverseFFT_Yonly(Complx *p, int n) {
+void Forward2dFFT(Complx *p, int n) {
+    // As Inverse2dFFT, but the forward transform
+    fftw_execute_dft(plan2d_forward, (fftw_complex *)p, (fftw_complex *)p);
+}
+void FFT_Yonly(Complx *p, int n, fftw_plan plan) {
     // Given a pointer to a 2d complex array, contiguously packed as p[n][n].
-    // Do the 1d inverse FFT on the first index (the long stride one)
+    // Do the 1d FFT of the plan on the first index (the long stride one)
     // for each value of the second index.
     // Note that the Y in the title doesn't refer to the Y direction in 
     // our 3-d problem!
@@ -100,11 +131,13 @@ void InverseFFT_Yonly(Complx *p, int n) {
     for (j=0;j<n;j++) {
         // We will load one row at a time
         for (k=0;k<n;k++) tmp[k] = p[k*n+j];
-        Inverse1dFFT(tmp, n);
+        fftw_execute_dft(plan, (fftw_complex *)tmp, (fftw_complex *)tmp);
         for (k=0;k<n;k++) p[k*n+j] = tmp[k];
     }
     delete []tmp;
 }
+void InverseFFT_Yonly(Complx *p, int n) { FFT_Yonly(p, n, plan1d); }
+void ForwardFFT_Yonly(Complx *p, int n) { FFT_Yonly(p, n, plan1d_forward); }
 
 //================================================================
 
@@ -217,7 +250,7 @@ eigenmode get_eigenmode(int kx, int ky, int kz, int ppd, int qPLT){
 }
 
 void LoadPlane(BlockArray& array, Parameters& param, PowerSpectrum& Pk, 
-                int yblock, int yres, Complx *slab, Complx *slabHer) {
+                int yblock, int yres, Complx *slab, Complx *slabHer, PkHistogram& modes) {
     Complx D,F,G,H,f;
     Complx I(0.0,1.0);
     double k2;
@@ -245,7 +278,12 @@ void LoadPlane(BlockArray& array, Parameters& param, PowerSpectrum& Pk,
             else if (param.qonemode && !(kx==param.one_mode[0] && ky==param.one_mode[1] && kz==param.one_mode[2])) D=0.0;
             // We deliberately only call cgauss() if we are inside the k_cutoff region
             // to get the same phase for a given k and cutoff region, no matter the ppd
-            else D = Pk.cgauss(sqrt(k2),yres);
+            else {
+                D = Pk.cgauss(sqrt(k2),yres,param.qfixed);
+                // Count the modes that survive the Hermitian copy of the ky=0 plane below
+                if (ky>0 || kz>0 || (kz==0 && kx>0))
+                    modes.Add(kx,ky,kz,sqrt(k2),D,Pk.power(sqrt(k2)));
+            }
             // D = 0.1;    // If we need a known level
             
             k2 /= param.fundamental; // Get units of F,G,H right
@@ -278,6 +316,18 @@ void LoadPlane(BlockArray& array, Parameters& param, PowerSpectrum& Pk,
                 AYZX(slab,2,yres,z,x) = Complx(0,0) + I*F*f;
                 AYZX(slab,3,yres,z,x) = G*f + I*H*f;
             }
+            // For 2LPT, the second derivatives of the potential, phi_ij = k_i k_j D/k^2,
+            // packed two to an array as for the displacements
+            double pxx, pyy, pzz, pxy, pxz, pyz;
+            if(param.q2LPT){
+                double kk = kx*kx+ky*ky+kz*kz;
+                if (kk==0.0) kk = 1.0;
+                pxx = kx*kx/kk; pyy = ky*ky/kk; pzz = kz*kz/kk;
+                pxy = kx*ky/kk; pxz = kx*kz/kk; pyz = ky*kz/kk;
+                AYZX(slab,2,yres,z,x) = pxx*D + I*(pyy*D);
+                AYZX(slab,3,yres,z,x) = pzz*D + I*(pxy*D);
+                AYZX(slab,4,yres,z,x) = pxz*D + I*(pyz*D);
+            }
             // And we need to store the complex conjugate
             // in the reflected entry.  We are reflecting
             // each element.  Note that we are storing one element
@@ -291,6 +341,11 @@ void LoadPlane(BlockArray& array, Parameters& param, PowerSpectrum& Pk,
                 AYZX(slabHer,2,yresHer,zHer,xHer) = 0. + I*conj(F*f);
                 AYZX(slabHer,3,yresHer,zHer,xHer) = conj(G*f) + I*conj(H*f);
             }
+            if(param.q2LPT){     // With the phi_ij from above
+                AYZX(slabHer,2,yresHer,zHer,xHer) = pxx*conj(D) + I*(pyy*conj(D));
+                AYZX(slabHer,3,yresHer,zHer,xHer) = pzz*conj(D) + I*(pxy*conj(D));
+                AYZX(slabHer,4,yresHer,zHer,xHer) = pxz*conj(D) + I*(pyz*conj(D));
+            }
         }
     } // End the x-z loops
 
@@ -330,32 +385,51 @@ void StoreBlock(BlockArray& array, int yblock, int zblock, Complx *slab) {
     //     [array=0..1][zresidual=0..P-1][yresidual=0..P-1][x=0..PPD-1]
     // Can't openMP an I/O loop.
     int a,yres,y,zres,z,yresHer;
-    array.bopen(yblock,zblock,"w");
+    BlockArray::BlockHandle h;
+    array.bopen(h,yblock,zblock,"w");
     for (a=0;a<array.narray;a++) 
     for (zres=0;zres<array.block;zres++) 
     for (yres=0;yres<array.block;yres++) {
         z = zres+array.block*zblock;
         y = yres+array.block*yblock;
         // Copy the whole X skewer
-        array.bwrite(&(AYZX(slab,a,yres,z,0)),array.ppd);
+        array.bwrite(h,&(AYZX(slab,a,yres,z,0)),array.ppd);
     }
-    array.bclose();
+    array.bclose(h);
     return;
 }
 
-void ZeldovichZ(BlockArray& array, Parameters& param, PowerSpectrum& Pk) {
+struct Slabs {
+    // The working memory of the passes: a slab of all of the arrays, a
+    // second for the Z pass, and, for 2LPT, four planes per thread to add
+    // the orders into.  It is allocated once, so that a batch reuses it
+    // for every realization.
+    Complx *slab, *slabHer, *combined;
+    Slabs(BlockArray& array, int qzpass, int q2LPT) {
+        unsigned long long int len = 1llu*array.block*array.ppd*array.ppd*array.narray;
+        slab    = new Complx[len];
+        slabHer = qzpass ? new Complx[len] : NULL;
+        combined = q2LPT ? new Complx[4llu*array.ppd*array.ppd*omp_get_max_threads()] : NULL;
+    }
+    ~Slabs() {
+        delete []slab;
+        delete []slabHer;
+        delete []combined;
+    }
+};
+
+void ZeldovichZ(BlockArray& array, Parameters& param, PowerSpectrum& Pk, Checkpoint& ckpt, Slabs& slabs) {
     // Generate the Fourier space density field, one Y block at a time
     // Use it to generate all arrays (density, qx, qy, qz) in Fourier space,
     // Do Z direction inverse FFTs.
     // Pack the result into 'array'.
-    Complx *slab, *slabHer;
+    Complx *slab = slabs.slab, *slabHer = slabs.slabHer;
     int a,x,yres,yblock,y,zres,zblock,z, yresHer,zHer,xHer;
-    unsigned long long int len = 1llu*array.block*array.ppd*array.ppd*array.narray;
-    slab    = new Complx[len];
-    slabHer = new Complx[len];
+    PkHistogram *modes = new PkHistogram[array.block];
+    for (yres=0;yres<array.block;yres++) modes[yres].Init(array.ppd);
     //
     printf("Looping over Y: ");
-    for (yblock=0;yblock<array.numblock/2;yblock++) {
+    for (yblock=ckpt.zdone;yblock<array.numblock/2;yblock++) {
         // We're going to do each pair of Y slabs separately.
         // Load the deltas and do the FFTs for each pair of planes
         printf(".."); fflush(stdout);
@@ -363,20 +437,31 @@ void ZeldovichZ(BlockArray& array, Parameters& param, PowerSpectrum& Pk) {
         {  //begin parallel region
             #pragma omp for private(yres) schedule(static,1)
             for (yres=0;yres<array.block;yres++) {     
-                LoadPlane(array,param,Pk,yblock,yres,slab,slabHer);
+                LoadPlane(array,param,Pk,yblock,yres,slab,slabHer,modes[yres]);
             }
         }//End Parallel region
+        // Combine the histograms in a fixed order
+        for (yres=0;yres<array.block;yres++) {
+            modes[yres].AddTo(measured_pk);
+            modes[yres].Clear();
+        }
 
         // Now store it into the primary BlockArray.  
-        // Can't openMP an I/O loop.
-        for (zblock=0;zblock<array.numblock;zblock++) {
-            StoreBlock(array,yblock,zblock,slab);
-            StoreBlock(array,array.numblock-1-yblock,zblock,slabHer);
+        // Can't openMP an I/O loop, but we can run one loop per swap device.
+        #pragma omp parallel for num_threads(array.nswapdir) schedule(static,1)
+        for (int dev=0;dev<array.nswapdir;dev++) {
+            for (int zb=0;zb<array.numblock;zb++) {
+                if (array.device(yblock,zb)==dev)
+                    StoreBlock(array,yblock,zb,slab);
+                if (array.device(array.numblock-1-yblock,zb)==dev)
+                    StoreBlock(array,array.numblock-1-yblock,zb,slabHer);
+            }
         }
+        ckpt.finish_zstep(yblock);
     }  // End yblock for loop
-    delete []slabHer;
-    delete []slab;
+    delete []modes;
     printf("\n"); fflush(stdout);
+    measured_pk.Report(param);
     return;
 }
 
@@ -385,93 +470,308 @@ void ZeldovichZ(BlockArray& array, Parameters& param, PowerSpectrum& Pk) {
 // We use a set of X-Y arrays of Complx numbers (ordered by A and Z).
 #define AZYX(_slab,_a,_z,_y,_x) _slab[(_x)+array.ppd*((_y)+array.ppd*((_a)+array.narray*(_z)))]
 
-void LoadBlock(BlockArray& array, int yblock, int zblock, Complx *slab) {
+void LoadBlock(BlockArray& array, int yblock, int zblock, Complx *slab, int qshift) {
     // We must be sure to access the block sequentially.
     // data[zblock=0..NB-1][yblock=0..NB-1]
     //     [array=0..1][zresidual=0..P-1][yresidual=0..P-1][x=0..PPD-1]
-    // Can't openMP an I/O loop.
-    int a,yres,y,zres,z,yshift;
-    array.bopen(yblock,zblock,"r");
+    // Each call has its own handle, so different blocks can be loaded
+    // concurrently; they land in disjoint parts of the slab.
+    // Blocks stored by StoreZBlock are in natural y order; load those without qshift.
+    int a,yres,y,zres,yshift,ystart,nrun;
+    BlockArray::BlockHandle h;
+    array.bopen(h,yblock,zblock,"r");
     for (a=0;a<array.narray;a++)
-    for (zres=0;zres<array.block;zres++) 
-    for (yres=0;yres<array.block;yres++) {
-        z = zres+array.block*zblock;
-        y = yres+array.block*yblock;
-        // Copy the whole X skewer.  However, we want to
-        // shift the y frequencies in the reflected half
-        // by one.
+    for (zres=0;zres<array.block;zres++) {
+        // The X skewers of one (a,zres) are contiguous in the file.
+        // We want to shift the y frequencies in the reflected half
+        // by one, so they land in at most two contiguous runs in the slab.
+        // Read each run at once.
         // FLAW: Assumes array.ppd is even.
-        if (y>=array.ppd/2) yshift=y+1; else yshift=y;
-        if (yshift==array.ppd) yshift=array.ppd/2;
-        // Put it somewhere; this is about to be overwritten
-        array.bread(&(AZYX(slab,a,zres,yshift,0)),array.ppd);
+        ystart = -1; nrun = 0;
+        for (yres=0;yres<array.block;yres++) {
+            y = yres+array.block*yblock;
+            if (qshift && y>=array.ppd/2) yshift=y+1; else yshift=y;
+            if (yshift==array.ppd) yshift=array.ppd/2;
+            // Put it somewhere; this is about to be overwritten
+            if (nrun>0 && yshift!=ystart+nrun) {
+                array.bread(h,&(AZYX(slab,a,zres,ystart,0)),nrun*array.ppd);
+                nrun = 0;
+            }
+            if (nrun==0) ystart = yshift;
+            nrun++;
+        }
+        array.bread(h,&(AZYX(slab,a,zres,ystart,0)),nrun*array.ppd);
     }
-    array.bclose();
+    array.bclose(h);
     return;
 }
 
-void ZeldovichXY(BlockArray& array, Parameters& param, FILE *output, FILE *densoutput) {
+void LoadZSlab(BlockArray& array, Parameters& param, int zblock, Complx *slab, int qshift) {
+    // Load the slab of Z block zblock.
+    // The blocks are independent, so we read them from a pool of I/O threads.
+    #pragma omp parallel for num_threads(param.io_threads) schedule(dynamic,1)
+    for (int yb=0;yb<array.numblock;yb++) {
+        LoadBlock(array, yb, zblock, slab, qshift);
+    }
+    if (!qshift) return;
+
+    // The Nyquist frequency y=array.ppd/2 must now be set to 0
+    // because we shifted the data by one location.
+    // FLAW: this assumes PPD is even.
+    int y = array.ppd/2;
+    for (int zres=0;zres<array.block;zres++) {
+        for (int a=0;a<array.narray;a++) {
+            for (int x=0;x<array.ppd;x++) AZYX(slab,a,zres,y,x) = 0.0;
+        }
+    }
+}
+
+// ===============================================================
+// Second-order (2LPT) displacements.  With D2 = -3/7 D1^2, we add
+//     Psi2 = D2 grad phi2,  where del^2 phi2 = S = sum_{i>j} (phi_ii phi_jj - phi_ij^2)
+// and phi_ij are the second derivatives of the first-order potential,
+// so that in Fourier space Psi2 = (3/7) i k S/k^2.  S is formed in real
+// space, so this takes a round trip through the BlockArray beyond the
+// first-order transforms: the Z pass also makes the six phi_ij (arrays 2-4);
+// SecondOrderXY takes each Z slab to real space, forms S, and transforms
+// it back in X & Y; SecondOrderZ finishes the transform of S in Z and
+// returns Psi2 (arrays 3 & 4) to real space in Z; and the XY pass does the
+// rest and adds the orders.  The first-order displacements stay in real
+// space, in arrays 0 & 1, from SecondOrderXY on.  The velocities are those
+// of EdS, with f2 = 2 f1.
+
+void StoreZBlock(BlockArray& array, int yblock, int zblock, Complx *slab) {
+    // Store a block of a Z slab, in natural y order.  The Y skewers of
+    // each (a,zres) are contiguous in both.
+    BlockArray::BlockHandle h;
+    array.bopen(h,yblock,zblock,"w");
+    for (int a=0;a<array.narray;a++)
+    for (int zres=0;zres<array.block;zres++)
+        array.bwrite(h,&(AZYX(slab,a,zres,yblock*array.block,0)),array.block*array.ppd);
+    array.bclose(h);
+}
+
+void LoadYBlock(BlockArray& array, int yblock, int zblock, Complx *slab) {
+    // Load a block into a Y slab; the inverse of StoreBlock
+    BlockArray::BlockHandle h;
+    array.bopen(h,yblock,zblock,"r");
+    for (int a=0;a<array.narray;a++)
+    for (int zres=0;zres<array.block;zres++)
+    for (int yres=0;yres<array.block;yres++)
+        array.bread(h,&(AYZX(slab,a,yres,zres+array.block*zblock,0)),array.ppd);
+    array.bclose(h);
+}
+
+void SecondOrderXY(BlockArray& array, Parameters& param, Slabs& slabs) {
+    // Take each Z slab to real space, put the source S in array 2,
+    // and take that back to Fourier space in X & Y.
+    Complx *slab = slabs.slab;
+    int n = array.ppd*array.ppd;
+    printf("Looping over Z for the 2LPT source: ");
+    for (int zblock=0;zblock<array.numblock;zblock++) {
+        printf("."); fflush(stdout);
+        LoadZSlab(array, param, zblock, slab, 1);
+        #pragma omp parallel for schedule(static,1)
+        for (int zres=0;zres<array.block;zres++) {
+            for (int a=0;a<array.narray;a++)
+                Inverse2dFFT(&(AZYX(slab,a,zres,0,0)),array.ppd);
+            Complx *p2 = &(AZYX(slab,2,zres,0,0));
+            Complx *p3 = &(AZYX(slab,3,zres,0,0));
+            Complx *p4 = &(AZYX(slab,4,zres,0,0));
+            for (int j=0;j<n;j++) {
+                double xx = real(p2[j]), yy = imag(p2[j]), zz = real(p3[j]);
+                double xy = imag(p3[j]), xz = real(p4[j]), yz = imag(p4[j]);
+                p2[j] = xx*yy+xx*zz+yy*zz-xy*xy-xz*xz-yz*yz;
+            }
+            Forward2dFFT(p2,array.ppd);
+        }
+        #pragma omp parallel for num_threads(array.nswapdir) schedule(static,1)
+        for (int dev=0;dev<array.nswapdir;dev++) {
+            for (int yb=0;yb<array.numblock;yb++)
+                if (array.device(yb,zblock)==dev) StoreZBlock(array,yb,zblock,slab);
+        }
+    }
+    printf("\n"); fflush(stdout);
+}
+
+void SecondOrderZ(BlockArray& array, Parameters& param, Slabs& slabs) {
+    // Take S to Fourier space in Z, one Y slab at a time, form Psi2 in
+    // arrays 3 & 4, packed as the first-order displacements are, and take
+    // it back to real space in Z.  The forward and inverse transforms
+    // bring a factor of PPD^3, which we take out here.
+    Complx *slab = slabs.slab;
+    Complx I(0.0,1.0);
+    double norm = 3.0/7.0/CUBE(array.ppd)/param.fundamental;
+    printf("Looping over Y for the 2LPT displacements: ");
+    for (int yblock=0;yblock<array.numblock;yblock++) {
+        printf("."); fflush(stdout);
+        #pragma omp parallel for num_threads(array.nswapdir) schedule(static,1)
+        for (int dev=0;dev<array.nswapdir;dev++) {
+            for (int zb=0;zb<array.numblock;zb++)
+                if (array.device(yblock,zb)==dev) LoadYBlock(array,yblock,zb,slab);
+        }
+        #pragma omp parallel for schedule(static,1)
+        for (int yres=0;yres<array.block;yres++) {
+            ForwardFFT_Yonly(&(AYZX(slab,2,yres,0,0)),array.ppd);
+            int y = yres+yblock*array.block;
+            int ky = y>array.ppd/2?y-array.ppd:y;        // Nyquist wrapping
+            for (int z=0;z<array.ppd;z++) {
+                int kz = z>array.ppd/2?z-array.ppd:z;
+                for (int x=0;x<array.ppd;x++) {
+                    int kx = x>array.ppd/2?x-array.ppd:x;
+                    double kk = kx*kx+ky*ky+kz*kz;
+                    Complx A = 0.0, B = 0.0;
+                    // The Nyquist elements would not be Hermitian, so drop them
+                    if (kk>0 && abs(kx)!=array.ppd/2 && abs(ky)!=array.ppd/2 && abs(kz)!=array.ppd/2) {
+                        Complx f = norm*I*AYZX(slab,2,yres,z,x)/kk;
+                        A = (double)kx*f + I*((double)ky*f);
+                        B = (double)kz*f;
+                    }
+                    AYZX(slab,3,yres,z,x) = A;
+                    AYZX(slab,4,yres,z,x) = B;
+                }
+            }
+            InverseFFT_Yonly(&(AYZX(slab,3,yres,0,0)),array.ppd);
+            InverseFFT_Yonly(&(AYZX(slab,4,yres,0,0)),array.ppd);
+        }
+        #pragma omp parallel for num_threads(array.nswapdir) schedule(static,1)
+        for (int dev=0;dev<array.nswapdir;dev++) {
+            for (int zb=0;zb<array.numblock;zb++)
+                if (array.device(yblock,zb)==dev) StoreBlock(array,yblock,zb,slab);
+        }
+    }
+    printf("\n"); fflush(stdout);
+}
+
+void AddSecondOrder(BlockArray& array, Complx *slab, int zres, double sign, Complx *out) {
+    // For plane zres of the slab, in real space, pack sign*Psi1+Psi2 into
+    // the first two of the four planes of out, and the velocity
+    // sign*Psi1+2*Psi2 into the other two, as for PLT.  The density is
+    // sign*delta.  With sign -1, this is the paired realization, whose
+    // second order is unchanged.
+    int n = array.ppd*array.ppd;
+    Complx *p0 = &(AZYX(slab,0,zres,0,0)), *p1 = &(AZYX(slab,1,zres,0,0));
+    Complx *p3 = &(AZYX(slab,3,zres,0,0)), *p4 = &(AZYX(slab,4,zres,0,0));
+    for (int j=0;j<n;j++) {
+        double dens = sign*real(p0[j]);
+        double x1 = sign*imag(p0[j]), y1 = sign*real(p1[j]), z1 = sign*imag(p1[j]);
+        double x2 = real(p3[j]), y2 = imag(p3[j]), z2 = real(p4[j]);
+        out[j] = Complx(dens, x1+x2);
+        out[j+n] = Complx(y1+y2, z1+z2);
+        out[j+2*n] = Complx(0.0, x1+2*x2);
+        out[j+3*n] = Complx(y1+2*y2, z1+2*z2);
+    }
+}
+
+void ZeldovichXY(BlockArray& array, Parameters& param, ParticleWriter& writer, ParticleWriter *pair,
+                GridWriter& grids, CICDensity& cic, Checkpoint& ckpt, int zstart, int zend, Slabs& slabs) {
     // Do the Y & X inverse FFT and output the results.
+    // Do the Z blocks [zstart,zend).
     // Do this one Z slab at a time; try to load the data in order.
     // Try to write the output file in z order
-    void WriteParticlesSlab(FILE *output, FILE *densoutput, 
-    int z, Complx *slab1, Complx *slab2, Complx *slab3, Complx *slab4,
-    BlockArray& array, Parameters& param);
-    Complx *slab;
-    unsigned long long int len = 1llu*array.block*array.ppd*array.ppd*array.narray;
-    slab = new Complx[len];
-    int a,x,yres,yblock,y,zres,zblock,z,yshift;
+    // If pair is given, it also writes the partner realization, whose every
+    // mode is negated.  The transforms are linear, so its planes are just
+    // the negated planes of ours, exactly; so we negate each plane in cache
+    // once it is converted, and convert it again.
+    // With 2LPT, the first order is already in real space, and the orders
+    // are added into four planes for each thread, which are converted
+    // instead; for the partner, only the first order is negated.
+    Complx *slab = slabs.slab, *combined = slabs.combined;
+    int n = array.ppd*array.ppd;
+    int zres,zblock,z;
     printf("Looping over Z: ");
-    for (zblock=0;zblock<array.numblock;zblock++) {
+    ckpt.begin_xy();
+    writer.SetRange((zstart+ckpt.xydone)*array.block, zend*array.block);
+    if (pair!=NULL) pair->SetRange((zstart+ckpt.xydone)*array.block, zend*array.block);
+    for (zblock=zstart+ckpt.xydone;zblock<zend;zblock++) {
         // We'll do one Z slab at a time
         // Load the slab back in.  
-        // Can't openMP an I/O loop.
         printf("."); fflush(stdout);
-        for (yblock=0;yblock<array.numblock;yblock++) {
-            LoadBlock(array, yblock, zblock, slab);
-        } 
-
-        // The Nyquist frequency y=array.ppd/2 must now be set to 0
-        // because we shifted the data by one location.
-        // FLAW: this assumes PPD is even.
-        y = array.ppd/2;
-        for (zres=0;zres<array.block;zres++) {
-            for (a=0;a<array.narray;a++) {
-                for (x=0;x<array.ppd;x++) AZYX(slab,a,zres,y,x) = 0.0;
-            }
-        }
+        LoadZSlab(array, param, zblock, slab, !param.q2LPT);
+        cic.StartBlock(zblock*array.block);
 
-        // Now we want to do the Y & X inverse FFT.
-        for (a=0;a<array.narray;a++) {
-            #pragma omp parallel
-            {
-                #pragma omp for private(zres) schedule(static,1)
-                for (zres=0;zres<array.block;zres++) {
-                    Inverse2dFFT(&(AZYX(slab,a,zres,0,0)),array.ppd);
+        // Now we want to do the Y & X inverse FFT, and write out these
+        // rows of [z][y][x] positions.  Each thread transforms a plane and
+        // converts it to particles while it is in cache.  Only the writes
+        // are serialized, in z order.
+        PlaneStats *stats = new PlaneStats[array.block];
+        // The writes themselves happen in the background, overlapping
+        // with the following planes and Z blocks.
+        #pragma omp parallel
+        {
+            #pragma omp for private(zres,z) ordered schedule(static,1)
+            for (zres=0;zres<array.block;zres++) {
+                Complx *plane[4];     // The planes to convert
+                if (param.q2LPT) {
+                    Inverse2dFFT(&(AZYX(slab,3,zres,0,0)),array.ppd);
+                    Inverse2dFFT(&(AZYX(slab,4,zres,0,0)),array.ppd);
+                    for (int aa=0;aa<4;aa++) plane[aa] = combined+(4*omp_get_thread_num()+aa)*(size_t)n;
+                    AddSecondOrder(array, slab, zres, 1.0, plane[0]);
+                } else {
+                    for (int aa=0;aa<array.narray;aa++)
+                        Inverse2dFFT(&(AZYX(slab,aa,zres,0,0)),array.ppd);
+                    for (int aa=0;aa<4;aa++) plane[aa] = &(AZYX(slab,aa,zres,0,0));
                 }
-            }//End parallel region
-        }
-
-        // Now write out these rows of [z][y][x] positions
-        // Can't openMP an I/O loop.
-        
-
-        for (zres=0;zres<array.block;zres++) {
-            z = zres+array.block*zblock;
-            if (param.qoneslab<0||z==param.qoneslab) {
+                z = zres+array.block*zblock;
+                if (param.qoneslab<0||z==param.qoneslab) {
+                    grids.WritePlane(z, plane[0], plane[1], array);
+                    cic.DepositPlane(z, plane[0], plane[1], array);
+                }
+                char *buffer = NULL;
+                size_t nbytes = 0;
+                unsigned long long hash[MAXCOLUMN];
                 // We have the option to output only one z slab.
-
-
-
-                WriteParticlesSlab(output,densoutput,z,
-                &(AZYX(slab,0,zres,0,0)), &(AZYX(slab,1,zres,0,0)),
-                &(AZYX(slab,2,zres,0,0)), &(AZYX(slab,3,zres,0,0)),
-                array, param);
+                if (param.qoneslab<0||z==param.qoneslab) {
+                    buffer = writer.GetBuffer();
+                    nbytes = writer.ConvertPlane(z, plane[0], plane[1], plane[2], plane[3],
+                        array, buffer, stats[zres]);
+                    nbytes = writer.CompressPlane(z, buffer, nbytes);
+                    writer.HashPlane(z, buffer, nbytes, hash);
+                }
+                char *pairbuffer = NULL;
+                size_t pairbytes = 0;
+                unsigned long long pairhash[MAXCOLUMN];
+                if (buffer!=NULL && pair!=NULL) {
+                    if (param.q2LPT) AddSecondOrder(array, slab, zres, -1.0, plane[0]);
+                    else for (int aa=0;aa<array.narray;aa++) {
+                        Complx *p = plane[aa];
+                        for (int j=0;j<n;j++) p[j] = -p[j];
+                    }
+                    PlaneStats pairstats;   // Not reported
+                    pairbuffer = pair->GetBuffer();
+                    pairbytes = pair->ConvertPlane(z, plane[0], plane[1], plane[2], plane[3],
+                        array, pairbuffer, pairstats);
+                    pairbytes = pair->CompressPlane(z, pairbuffer, pairbytes);
+                    pair->HashPlane(z, pairbuffer, pairbytes, pairhash);
+                }
+                #pragma omp ordered
+                {
+                    if (buffer!=NULL) writer.WritePlane(z, buffer, nbytes, hash);
+                    if (pairbuffer!=NULL) pair->WritePlane(z, pairbuffer, pairbytes, pairhash);
+                }
             }
-        }
+        }//End parallel region
+        // Combine the reductions in a fixed order
+        for (zres=0;zres<array.block;zres++) stats[zres].AddToGlobals();
+        delete []stats;
+        // The journal records the ic_ file sizes, so they must be complete
+        if (ckpt.enabled) { writer.Flush(); writer.SavePieces(); }
+        ckpt.finish_xystep(zblock);
     } // End zblock for loop
-    delete []slab;
+    writer.Close();
+    if (pair!=NULL) pair->Close();
     printf("\n"); fflush(stdout);
+    writer.Summary();
+    writer.ReportCompression();
+    if (pair!=NULL) pair->ReportCompression();
+    if (param.qmanifest) {
+        int ndone = WriteManifest(param, writer.output_dir);
+        printf("The manifest lists %d complete output files.\n", ndone);
+        if (pair!=NULL) {
+            ndone = WriteManifest(param, pair->output_dir);
+            printf("The manifest of the paired realization lists %d complete output files.\n", ndone);
+        }
+    }
     return;
 }
 
@@ -505,25 +805,262 @@ void load_eigmodes(Parameters &param){
     eigf.close();
 }
 
+// ===============================================================
+// The Z pass and the XY pass can be run as separate jobs, and the XY pass
+// can be split over ranges of Z blocks.  Each XY range job writes its
+// reductions to a small file, and the finalize stage combines them.
+
+enum { STAGE_ALL, STAGE_Z, STAGE_XY, STAGE_FINALIZE, STAGE_VERIFY };
+
+void WriteReductions(Parameters& param, int zstart, int zend) {
+    char fn[1100];
+    sprintf(fn,"%s/zeldovich.reductions.%d.%d",param.output_dir,zstart,zend);
+    FILE *fp = fopen(fn,"w");
+    assert(fp!=NULL);
+    fprintf(fp,"# zblock_start zblock_end density_variance max_disp[3]\n");
+    fprintf(fp,"%d %d %.17g %.17g %.17g %.17g\n",zstart,zend,
+        density_variance,max_disp[0],max_disp[1],max_disp[2]);
+    fclose(fp);
+}
+
+int MergeReductions(Parameters& param, std::vector<std::pair<int,int> >& ranges) {
+    // Combine the reductions of all of the XY range jobs, and list their
+    // Z block ranges.  Return 0 if they cover every Z block exactly once.
+    char fn[1100];
+    int zstart, zend, nfile = 0;
+    double dv, md[3];
+    int *covered = new int[param.numblock];
+    for (int j=0;j<param.numblock;j++) covered[j] = 0;
+    density_variance = 0.0;
+    for (int i=0;i<3;i++) max_disp[i] = 0.0;
+
+    DIR *dir = opendir(param.output_dir);
+    assert(dir!=NULL);
+    struct dirent *ent;
+    while ((ent=readdir(dir))!=NULL) {
+        if (sscanf(ent->d_name,"zeldovich.reductions.%d.%d",&zstart,&zend)!=2) continue;
+        sprintf(fn,"%s/%s",param.output_dir,ent->d_name);
+        FILE *fp = fopen(fn,"r");
+        assert(fp!=NULL);
+        int ok = fscanf(fp,"%*[^\n] %d %d %lf %lf %lf %lf",&zstart,&zend,&dv,md,md+1,md+2)==6;
+        fclose(fp);
+        if (!ok) { fprintf(stderr,"Error: could not parse %s\n",fn); return 1; }
+        for (int j=zstart;j<zend&&j<param.numblock;j++) covered[j]++;
+        ranges.push_back(std::make_pair(zstart,zend));
+        density_variance += dv;
+        for (int i=0;i<3;i++) max_disp[i] = md[i] > max_disp[i] ? md[i] : max_disp[i];
+        nfile++;
+    }
+    closedir(dir);
+    int status = 0;
+    for (int j=0;j<param.numblock;j++) if (covered[j]!=1) {
+        fprintf(stderr,"Error: Z block %d was done by %d XY jobs.\n",j,covered[j]);
+        status = 1;
+    }
+    delete []covered;
+    printf("Merged the reductions of %d XY jobs.\n",nfile);
+    return status;
+}
+
+void PrintSummary(Parameters& param, PowerSpectrum& Pk) {
+    printf("The rms density variation of the pixels is %f\n", sqrt(density_variance/CUBE(param.ppd)));
+    printf("This could be compared to the P(k) prediction of %f\n",
+    Pk.sigmaR(param.separation/4.0)*pow(param.boxsize,1.5));
+    
+    printf("The maximum component-wise displacements are (%g, %g, %g).\n", max_disp[0], max_disp[1], max_disp[2]);
+    printf("For Abacus' 2LPT implementation to work (assuming FINISH_WAIT_RADIUS = 1),\nthis implies a maximum CPD of %d\n", (int) (param.boxsize/(2*max_disp[2])));  // The slab direction is z in this code
+}
+
+// ===============================================================
+// A batch makes one realization per seed, in one process, so that the
+// setup (the parameters, P(k), the PLT eigenmodes, the FFTW plans, and
+// the swap space) is done once.  Each realization goes in the
+// subdirectory seed_<seed> of InitialConditionsDirectory.
+
+#define MAXSEEDS 100000     // The most realizations in one batch
+
+int ParseSeeds(int argc, char *argv[], std::vector<int>& seeds) {
+    // Each argument is a seed, or an inclusive range of seeds first-last,
+    // as positive integers with nothing else
+    for (int j=3;j<argc;j++) {
+        char *end = argv[j];
+        long first = 0, last = 0;
+        int ok = isdigit((unsigned char)*end);
+        if (ok) { errno = 0; first = last = strtol(end, &end, 10); ok = errno==0; }
+        if (ok && *end=='-') {
+            ok = isdigit((unsigned char)end[1]);
+            if (ok) { errno = 0; last = strtol(end+1, &end, 10); ok = errno==0; }
+        }
+        if (!ok || *end!='\0' || first<=0 || last<first || last>INT_MAX
+                || last-first>=MAXSEEDS-(long)seeds.size()) {
+            fprintf(stderr,"Error: %s is not a positive seed or a range of seeds first-last.\n",argv[j]);
+            return 1;
+        }
+        for (long seed=first;seed<=last;seed++) seeds.push_back((int)seed);
+    }
+    return 0;
+}
+
+struct OutputNames {
+    // The output locations of the parameter file, before a batch changes them
+    char output_dir[1024], density_filename[200], cic_filename[200];
+};
+
+int StartRealization(Parameters& param, OutputNames& base, int seed) {
+    // Point the output at the realization's directory, reseed the RNGs,
+    // and clear the running reductions, so that it starts as a fresh run
+    // with that seed would.  Relative grid file names are taken within
+    // the directory.  Return 0 if all is well.
+    int ok = snprintf(param.output_dir, sizeof(param.output_dir), "%s/seed_%d",
+        base.output_dir, seed)<(int)sizeof(param.output_dir);
+    if (ok && base.density_filename[0]!='/')
+        ok = snprintf(param.density_filename, sizeof(param.density_filename), "%s/%s",
+            param.output_dir, base.density_filename)<(int)sizeof(param.density_filename);
+    if (ok && base.cic_filename[0]!='/')
+        ok = snprintf(param.cic_filename, sizeof(param.cic_filename), "%s/%s",
+            param.output_dir, base.cic_filename)<(int)sizeof(param.cic_filename);
+    if (!ok) {
+        fprintf(stderr,"Error: the output names for seed %d are too long.\n",seed);
+        return 1;
+    }
+    if (mkdir(param.output_dir, 0755)!=0 && errno!=EEXIST) {
+        fprintf(stderr,"Error: could not make %s: %s\n",param.output_dir,strerror(errno));
+        return 1;
+    }
+    param.seed_rng(seed);
+    density_variance = 0.0;
+    for (int i=0;i<3;i++) max_disp[i] = 0.0;
+    max_quant_err[0] = max_quant_err[1] = 0.0;
+    measured_pk.Clear();
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2){
-        printf("Usage: %s param_file\n", argv[0]);
+    int stage = STAGE_ALL, zstart = 0, zend = -1, qbatch = 0;
+    if (argc==3 && strcmp(argv[2],"z")==0) stage = STAGE_Z;
+    else if (argc==3 && strcmp(argv[2],"finalize")==0) stage = STAGE_FINALIZE;
+    else if (argc==3 && strcmp(argv[2],"verify")==0) stage = STAGE_VERIFY;
+    else if (argc==3 && strcmp(argv[2],"xy")==0) stage = STAGE_XY;
+    else if (argc==5 && strcmp(argv[2],"xy")==0) {
+        stage = STAGE_XY; zstart = atoi(argv[3]); zend = atoi(argv[4]);
+    } else if (argc>=4 && strcmp(argv[2],"batch")==0) qbatch = 1;
+    else if (argc != 2){
+        printf("Usage: %s param_file [z | xy [zblock_start zblock_end] | finalize | verify | batch seed|first-last ...]\n", argv[0]);
         exit(1);
     }
     
-    FILE *output, *densoutput;
     double memory;
     density_variance = 0.0;
     Parameters param(argv[1]);
+    if (stage==STAGE_VERIFY) {
+        int nbad = VerifyManifest(param.output_dir);
+        if (param.qpaired) {
+            char dir[1100];
+            sprintf(dir, "%s/paired", param.output_dir);
+            nbad += VerifyManifest(dir);
+        }
+        return nbad!=0;
+    }
 
     PowerSpectrum Pk(10000);
     if (Pk.LoadPower(param.Pk_filename,param)!=0) return 1;
     param.append_file_to_comments(param.Pk_filename);
 
+    if (stage==STAGE_FINALIZE) {
+        std::vector<std::pair<int,int> > ranges;
+        if (MergeReductions(param, ranges)!=0) return 1;
+        PrintSummary(param, Pk);
+        CICDensity cic(param, 1);
+        int njob = cic.Merge(ranges);
+        if (njob<0) return 1;
+        if (njob>0) cic.Write();
+        if (param.qmanifest) {
+            printf("The manifest lists %d complete output files.\n", WriteManifest(param, param.output_dir));
+            if (param.qpaired) {
+                char dir[1100];
+                sprintf(dir, "%s/paired", param.output_dir);
+                printf("The manifest of the paired realization lists %d complete output files.\n",
+                    WriteManifest(param, dir));
+            }
+        }
+        return 0;
+    }
+    if (zend<0) zend = param.numblock;
+    if (zstart<0 || zend>param.numblock || zstart>=zend) {
+        fprintf(stderr,"Error: the Z block range [%d,%d) is not within [0,%d).\n",zstart,zend,param.numblock);
+        return 1;
+    }
+    if (param.particles_per_file>0 && param.file_bytes>0) {
+        fprintf(stderr,"Error: set only one of ZD_ParticlesPerFile and ZD_FileBytes.\n");
+        return 1;
+    }
+    std::vector<int> seeds;
+    OutputNames base;
+    strcpy(base.output_dir, param.output_dir);
+    strcpy(base.density_filename, param.density_filename);
+    strcpy(base.cic_filename, param.cic_filename);
+    if (qbatch && (ParseSeeds(argc, argv, seeds)!=0 || StartRealization(param, base, seeds[0])!=0)) return 1;
+    ParticleWriter *writer = NewParticleWriter(param);
+    ParticleWriter *pair = param.qpaired && stage!=STAGE_Z ? NewPairedWriter(param) : NULL;
+    if ((param.particles_per_file>0 || param.file_bytes>0) && writer->planes_per_file==0) {
+        fprintf(stderr,"Error: ZD_ParticlesPerFile and ZD_FileBytes need a binary format of a fixed size per plane,\n"
+            "and can't be used with ZD_qfinalslab.\n");
+        return 1;
+    }
+    if (param.qcellsort && !writer->cellsort) {
+        fprintf(stderr,"Error: ZD_qcellsort needs the RVdoubleZel, RVZel or Zeldovich ICFormat.\n");
+        return 1;
+    }
+    if (param.qcellsort && param.qcheckpoint) {
+        // A resumed run would rewrite planes of files already sorted
+        fprintf(stderr,"Error: ZD_qcellsort can't be used with ZD_qcheckpoint.\n");
+        return 1;
+    }
+    if (param.cic_grid>0 && param.qcheckpoint) {
+        // The grid is in memory until the end, so it can't be resumed
+        fprintf(stderr,"Error: ZD_CICGrid can't be used with ZD_qcheckpoint.\n");
+        return 1;
+    }
+    if (param.qpaired && param.qcheckpoint) {
+        // The journal follows the files of one writer
+        fprintf(stderr,"Error: ZD_qpaired can't be used with ZD_qcheckpoint.\n");
+        return 1;
+    }
+    if (param.q2LPT && (param.qPLT || param.qcheckpoint || stage!=STAGE_ALL)) {
+        // The extra passes come between the Z and XY passes, and aren't journaled
+        fprintf(stderr,"Error: ZD_q2LPT can't be used with ZD_qPLT or ZD_qcheckpoint,\n"
+            "and the Z and XY passes must be done by one job.\n");
+        return 1;
+    }
+    // XY ranges that meet within a file may only write it at the same time
+    // if the format writes each plane in place.
+    int block = param.ppd/param.numblock;
+    if (!writer->shareable && (!writer->StartsFile(zstart*block) || !writer->StartsFile(zend*block))) {
+        fprintf(stderr,"Error: the Z block range [%d,%d) must start and end on an output file boundary.\n",zstart,zend);
+        return 1;
+    }
+    // Binned particles cross into the neighbouring files, including from the
+    // last slab to the first
+    if (writer->binning && (zstart!=0 || zend!=param.numblock)) {
+        fprintf(stderr,"Error: with ZD_qfinalslab, the XY pass must be done by one job.\n");
+        return 1;
+    }
+
     //param.print(stdout);   // Inform the command line user
-    memory = CUBE(param.ppd/1024.0)*2*sizeof(Complx);
+    // Two arrays for dens,x,y,z, two more for vx,vy,vz, or three more for the 2LPT phi_ij
+    int narray = param.qPLT ? 4 : (param.q2LPT ? 5 : 2);
+    memory = CUBE(param.ppd/1024.0)*narray*sizeof(Complx);
     printf("Total memory usage (GB): %5.3f\n", memory);
-    printf("Two slab memory usage (GB): %5.3f\n", memory/param.numblock*2.0);
+    double twoslab = memory/param.numblock*2.0;
+    printf("Two slab memory usage (GB): %5.3f\n", twoslab);
+    double planememory = 0.0;
+    if (param.q2LPT) {
+        // The XY pass adds the two orders into four planes for each thread
+        planememory = CUBE(1.0/1024.0)*4.0*param.ppd*param.ppd*sizeof(Complx)*omp_get_max_threads();
+        printf("2LPT plane memory (GB): %5.3f, four planes for each of %d threads\n",
+            planememory, omp_get_max_threads());
+    }
+    if (param.qfloatswap) memory /= 2.0;   // The swap is stored as ComplxFloat
     printf("File sizes (GB): %5.3f\n", memory/param.numblock/param.numblock);
 
     /*
@@ -534,13 +1071,7 @@ int main(int argc, char *argv[]) {
         else param.print(output,"zeldovich_3float");
     }
 */
-    if (param.qdensity>0) {
-        densoutput = fopen(param.density_filename,"w");
-        assert(densoutput!=NULL);
-        if (param.qnoheader==0) param.print(densoutput,"zeldovich_1float");
-    } else densoutput = NULL;
-
-    if(param.qPLT){
+    if(param.qPLT && stage!=STAGE_XY){
         load_eigmodes(param);
     }
     
@@ -548,24 +1079,70 @@ int main(int argc, char *argv[]) {
         printf("Using k_cutoff = %f (effective ppd = %d)\n", param.k_cutoff, (int)(param.ppd/param.k_cutoff+.5));
     }
 
-    Setup_FFTW(param.ppd);
-    // Two arrays for dens,x,y,z, two more for vx,vy,vz
-    int narray = param.qPLT ? 4 : 2;
-    BlockArray array(param.ppd,param.numblock,narray,param.output_dir,param.ramdisk);    
-    srandom(param.seed);
-    ZeldovichZ(array, param, Pk);
-    output = 0; // Current implementation doesn't use user-provided output
-    ZeldovichXY(array, param, output, densoutput);
+    if (stage!=STAGE_Z) {
+        // The queued output planes are held in memory alongside the two slabs
+        double buffermemory = writer->BufferMemory()/CUBE(1024.0);
+        printf("Output buffer memory (GB): %5.3f in %d buffers, for %d writer threads\n",
+            buffermemory, writer->nbuffer, writer->nwriter);
+        if (pair!=NULL) {
+            buffermemory *= 2;
+            printf("And the same again for the paired realization\n");
+        }
+        printf("Two slab plus %soutput buffer memory (GB): %5.3f\n",
+            param.q2LPT ? "2LPT plane and " : "", twoslab+planememory+buffermemory);
+        if (writer->SortMemory()>0)
+            printf("Cell sort memory (GB): %5.3f, for each of %d writer threads while it sorts a file\n",
+                writer->SortMemory()/CUBE(1024.0), writer->nwriter);
+    }
+    if (stage!=STAGE_Z && param.cic_grid>0)
+        printf("CIC density memory (GB): %5.3f, the grid and a window of %d of its planes for each of %d threads\n",
+            CICDensity::Memory(param, omp_get_max_threads())/CUBE(1024.0),
+            CICDensity::WindowPlanes(param), omp_get_max_threads());
+    Setup_FFTW(param.ppd, param.q2LPT);
+    BlockArray array(param.ppd,param.numblock,narray,
+        strlen(param.swap_dirs)>0?param.swap_dirs:base.output_dir,
+        param.ramdisk,param.qfloatswap);
+    if (param.io_threads<=0) param.io_threads = array.nswapdir;
+    measured_pk.Init(param.ppd);
 
-    printf("The rms density variation of the pixels is %f\n", sqrt(density_variance/CUBE(param.ppd)));
-    printf("This could be compared to the P(k) prediction of %f\n",
-    Pk.sigmaR(param.separation/4.0)*pow(param.boxsize,1.5));
-    
-    printf("The maximum component-wise displacements are (%g, %g, %g).\n", max_disp[0], max_disp[1], max_disp[2]);
-    printf("For Abacus' 2LPT implementation to work (assuming FINISH_WAIT_RADIUS = 1),\nthis implies a maximum CPD of %d\n", (int) (param.boxsize/(2*max_disp[2])));  // The slab direction is z in this code
-    // fclose(output);
+    // Everything that a realization needs is set up once; a batch resets
+    // it for each of the others.
+    Slabs slabs(array, stage!=STAGE_XY, param.q2LPT);
+    CICDensity cic(param, stage!=STAGE_Z ? omp_get_max_threads() : 0);
+    GridWriter *grids = stage!=STAGE_Z ? new GridWriter(param) : NULL;
+    int nrealization = qbatch ? seeds.size() : 1;
+    for (int r=0;r<nrealization;r++) {
+        if (r>0) {
+            if (StartRealization(param, base, seeds[r])!=0) return 1;
+            writer->Reset(param.output_dir);
+            if (pair!=NULL) ResetPairedWriter(pair, param);
+            if (grids!=NULL) grids->Reset();
+            cic.Reset();
+        }
+        if (qbatch) printf("Realization %d of %d, with ZD_Seed = %d, in %s\n",
+            r+1, nrealization, param.seed, param.output_dir);
+        srandom(param.seed);
+        Checkpoint ckpt(param, narray, zstart, zend, stage==STAGE_XY, *writer);
+        if (stage!=STAGE_XY) ZeldovichZ(array, param, Pk, ckpt, slabs);
+        if (param.q2LPT) {
+            SecondOrderXY(array, param, slabs);
+            SecondOrderZ(array, param, slabs);
+        }
+        if (stage!=STAGE_Z) ZeldovichXY(array, param, *writer, pair, *grids, cic, ckpt, zstart, zend, slabs);
+
+        if (stage==STAGE_XY) {
+            WriteReductions(param, zstart, zend);
+            cic.WritePartial(zstart, zend);
+        } else if (stage==STAGE_ALL) {
+            PrintSummary(param, Pk);
+            cic.Write();
+        }
+    }
+    delete grids;
+    delete writer;
+    delete pair;
     
-    if(param.qPLT)
+    if(param.qPLT && stage!=STAGE_XY)
         free(eig_vecs);
     
     return 0;